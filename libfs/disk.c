@@ -1,144 +1,2305 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+/* <linux/fs.h>, included by <linux/io_uring.h>, has its own BLOCK_SIZE */
+#undef BLOCK_SIZE
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Most buffers a single vectored system call accepts */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* No cache slot */
+#define NO_SLOT -1
+
+/* Most blocks written back with the disk lock held, and with one transfer */
+#define WRITEBACK_BATCH 64
+
+/* Trace records buffered before they are written to the trace file */
+#define TRACE_BUFFER 4096
+
+/* Fewest blocks of the default cache of a disk with large blocks */
+#define CACHE_MIN_BLOCKS 16
+
+/* Cached copy of a disk block */
+struct cache_entry {
+	/* Block index, only meaningful when the entry is in use */
+	size_t block;
+	/* Whether the entry holds a block */
+	int used;
+	/* Whether the cached copy is newer than the disk's, and since when (in
+	 * milliseconds of the monotonic clock) */
+	int dirty;
+	unsigned long dirtied;
+	/* Number of block_pin() references, a pinned entry is never evicted */
+	int pins;
+	/* LRU list links (slot indexes) */
+	int prev, next;
+	/* Hash chain link (slot index) */
+	int hnext;
+	/* Block content */
+	char *data;
+};
+
+/* Dirty slot to write back, ordered by @key (age, then block index) */
+struct cache_wb {
+	unsigned long key;
+	int slot;
+};
+
+/* Write-back LRU block cache */
+struct block_cache {
+	/* Number of slots */
+	size_t size;
+	/* Slots and their backing memory */
+	struct cache_entry *entries;
+	char *mem;
+	/* Hash buckets (slot indexes), @nbuckets is a power of two */
+	int *buckets;
+	size_t nbuckets;
+	/* Most and least recently used slots */
+	int head, tail;
+	/* Number of pinned and of dirty slots */
+	size_t pinned;
+	size_t ndirty;
+	/* Scratch space to order the dirty slots when writing them back */
+	struct cache_wb *wb;
+	/* Statistics */
+	struct block_cache_stats stats;
+};
+
+/* Worker threads of the thread pool asynchronous backend */
+#define AIO_THREADS 4
+
+/* Asynchronous request backends */
+enum aio_backend {
+	AIO_NONE,
+	/* Requests served at submission time (mapped disk) */
+	AIO_SYNC,
+	/* Requests handed to worker threads */
+	AIO_THREADS_POOL,
+	/* Requests submitted to an io_uring instance */
+	AIO_URING,
+};
+
+/* Asynchronous block request */
+struct aio_req {
+	/* Disk the request transfers from or to */
+	struct disk *disk;
+	/* Whether the request writes to the disk */
+	int write;
+	/* First block and number of blocks */
+	size_t block, nblocks;
+	/* Private copy of the caller's buffer list */
+	struct iovec *iov;
+	int iovcnt;
+	/* Caller's cookie */
+	void *user;
+	/* 0 on success, -1 on failure */
+	int result;
+	/* Queue link */
+	struct aio_req *next;
+};
+
+/* FIFO of requests */
+struct aio_queue {
+	struct aio_req *head, *tail;
+};
+
+/* io_uring instance, shared with the kernel through mapped rings */
+struct aio_ring {
+	int fd;
+	/* Submission ring */
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/* Completion ring */
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* Asynchronous block engine */
+struct block_aio {
+	enum aio_backend backend;
+	/*
+	 * Maximum and current number of requests submitted but not reaped,
+	 * @inflight is updated atomically
+	 */
+	unsigned int depth, inflight;
+	/* Completed requests not reaped yet, protected by @lock */
+	struct aio_queue done;
+	/* Thread pool: pending requests, protected by @lock */
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond, done_cond;
+	struct aio_queue pending;
+	pthread_t threads[AIO_THREADS];
+	int stop;
+	/* io_uring instance */
+	struct aio_ring ring;
+};
+
+/* Ranges the prefetch thread can have queued */
+#define PREFETCH_QUEUE 32
+
+/* Most bytes the prefetch thread reads with a single transfer */
+#define PREFETCH_BYTES (64 * 4096)
+
+/* Readahead into the block cache, served by a background thread */
+struct block_prefetch {
+	/* Queued ranges, a ring of %PREFETCH_QUEUE entries */
+	size_t block[PREFETCH_QUEUE], nblocks[PREFETCH_QUEUE];
+	unsigned int head, count;
+	/* Worker thread, started by the first request */
+	pthread_t thread;
+	pthread_cond_t cond;
+	int running, stop;
+	/* Bumped after every write reaching the disk image */
+	unsigned long gen;
+	/* Asynchronous writes submitted but not reaped */
+	unsigned int writes;
+	/* Most blocks read with a single transfer, and a bounce buffer of as
+	 * many blocks */
+	size_t max;
+	char *buf;
+};
 
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
-	/* Block count */
+	/* Block count, and block size in bytes */
 	size_t bcount;
+	size_t bsize;
+	/* Dirty blocks above which writers write back themselves, 0 if
+	 * vectored writes bypass the cache */
+	size_t dirty_limit;
+	/* Mapping of the whole disk image, NULL unless opened with
+	 * %BLOCK_DISK_MMAP */
+	char *map;
+	/* Block cache (always empty when the image is mapped) */
+	struct block_cache cache;
+	/* Protects @cache and @prefetch's queue, so that the disk can be
+	 * shared between threads */
+	pthread_mutex_t lock;
+	/* Asynchronous block engine */
+	struct block_aio aio;
+	/* Readahead engine */
+	struct block_prefetch prefetch;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Disk opened with block_disk_open(), NULL if none */
+static struct disk *cur_disk;
 
-int block_disk_open(const char *diskname)
+/* Requested cache size, applied when a disk is opened */
+static size_t cache_size = BLOCK_CACHE_DEFAULT;
+
+/* Transfers of every disk, updated with relaxed atomics */
+#ifndef NO_STATS
+static struct block_io_stats io_stats;
+#define io_stat_add(field, n) \
+	__atomic_fetch_add(&io_stats.field, (n), __ATOMIC_RELAXED)
+#else
+#define io_stat_add(field, n) do { } while (0)
+#endif
+
+/* Block trace, recording the transfers requested from every disk */
+static struct block_trace {
+	/* Protects everything below, taken last */
+	pthread_mutex_t lock;
+	/* Set while tracing, read without the lock */
+	int on;
+	/* Trace file */
+	int fd;
+	/* Time the trace started at, in ns */
+	uint64_t start;
+	/* Block size of the traced disks, 0 until the first record */
+	size_t bsize;
+	/* Records not written to the trace file yet */
+	struct block_trace_rec buf[TRACE_BUFFER];
+	size_t count;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+/* Label of the calling thread's transfers, see block_trace_tag() */
+static __thread uint8_t trace_tag;
+
+static void trace_record(int op, size_t bsize, size_t block, size_t nblocks);
+
+static inline void trace_xfer(struct disk *disk, int op, size_t block,
+			      size_t nblocks)
+{
+	if (__atomic_load_n(&trace.on, __ATOMIC_RELAXED))
+		trace_record(op, disk->bsize, block, nblocks);
+}
+
+static void prefetch_stop(struct disk *disk);
+
+void block_iov_copy(int to_iov, const struct iovec *iov, size_t off, void *buf,
+		    size_t len)
+{
+	char *p = buf;
+
+	while (off >= iov->iov_len) {
+		off -= iov->iov_len;
+		iov++;
+	}
+
+	while (len) {
+		size_t n = iov->iov_len - off;
+
+		if (n > len)
+			n = len;
+		if (to_iov)
+			memcpy((char *)iov->iov_base + off, p, n);
+		else
+			memcpy(p, (char *)iov->iov_base + off, n);
+		p += n;
+		len -= n;
+		off = 0;
+		iov++;
+	}
+}
+
+int block_iov_slice(const struct iovec *iov, size_t off, size_t len,
+		    struct iovec *out)
+{
+	int n = 0;
+
+	while (off >= iov->iov_len) {
+		off -= iov->iov_len;
+		iov++;
+	}
+
+	while (len) {
+		size_t l = iov->iov_len - off;
+
+		if (l > len)
+			l = len;
+		out[n].iov_base = (char *)iov->iov_base + off;
+		out[n].iov_len = l;
+		n++;
+		len -= l;
+		off = 0;
+		iov++;
+	}
+
+	return n;
+}
+
+/* Total length of the buffers described by @iov */
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	return len;
+}
+/*
+ * Transfer the blocks starting at @block from or to the buffers described by
+ * @iov with positional I/O, so that the file offset is never shared. Short
+ * transfers are resumed until every buffer is consumed.
+ */
+static int raw_xferv(struct disk *disk, int write, size_t block,
+		     const struct iovec *iov, int iovcnt)
+{
+	struct iovec local[8], *vec = local, *cur;
+	off_t off = (off_t)block * disk->bsize;
+	size_t len = iov_length(iov, iovcnt);
+	ssize_t n;
+
+	if (write) {
+		io_stat_add(writes, len / disk->bsize);
+		io_stat_add(write_calls, 1);
+	} else {
+		io_stat_add(reads, len / disk->bsize);
+		io_stat_add(read_calls, 1);
+	}
+
+	/* A mapped image is accessed with plain memory copies */
+	if (disk->map) {
+		if (write)
+			block_iov_copy(0, iov, 0, disk->map + off, len);
+		else
+			block_iov_copy(1, iov, 0, disk->map + off, len);
+		return 0;
+	}
+
+	if (iovcnt > (int)(sizeof(local) / sizeof(local[0]))) {
+		vec = malloc(iovcnt * sizeof(struct iovec));
+		if (!vec) {
+			perror("malloc");
+			return -1;
+		}
+	}
+	memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+	cur = vec;
+
+	while (iovcnt) {
+		int cnt = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+		if (write)
+			n = pwritev(disk->fd, cur, cnt, off);
+		else
+			n = preadv(disk->fd, cur, cnt, off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror(write ? "pwritev" : "preadv");
+			break;
+		}
+		if (n == 0) {
+			block_error("unexpected end of disk image");
+			break;
+		}
+
+		off += n;
+		/* Skip the buffers that were fully transferred */
+		while (iovcnt && (size_t)n >= cur->iov_len) {
+			n -= cur->iov_len;
+			cur++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			cur->iov_base = (char *)cur->iov_base + n;
+			cur->iov_len -= n;
+		}
+	}
+
+	if (vec != local)
+		free(vec);
+
+	/* Blocks read ahead before now may be stale */
+	if (write)
+		__atomic_add_fetch(&disk->prefetch.gen, 1, __ATOMIC_RELEASE);
+
+	return iovcnt ? -1 : 0;
+}
+
+static int raw_write(struct disk *disk, size_t block, const void *buf)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = disk->bsize };
+
+	return raw_xferv(disk, 1, block, &iov, 1);
+}
+
+static int raw_read(struct disk *disk, size_t block, void *buf)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = disk->bsize };
+
+	return raw_xferv(disk, 0, block, &iov, 1);
+}
+
+static size_t cache_hash(struct block_cache *c, size_t block)
+{
+	return (block * 2654435761u) & (c->nbuckets - 1);
+}
+
+static int cache_lookup(struct block_cache *c, size_t block)
+{
+	int slot = c->buckets[cache_hash(c, block)];
+
+	while (slot != NO_SLOT && c->entries[slot].block != block)
+		slot = c->entries[slot].hnext;
+
+	return slot;
+}
+
+static void cache_hash_remove(struct block_cache *c, int slot)
+{
+	int *link = &c->buckets[cache_hash(c, c->entries[slot].block)];
+
+	while (*link != slot)
+		link = &c->entries[*link].hnext;
+	*link = c->entries[slot].hnext;
+}
+
+static void cache_lru_unlink(struct block_cache *c, int slot)
+{
+	struct cache_entry *e = &c->entries[slot];
+
+	if (e->prev != NO_SLOT)
+		c->entries[e->prev].next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NO_SLOT)
+		c->entries[e->next].prev = e->prev;
+	else
+		c->tail = e->prev;
+}
+
+static void cache_lru_push(struct block_cache *c, int slot)
+{
+	struct cache_entry *e = &c->entries[slot];
+
+	e->prev = NO_SLOT;
+	e->next = c->head;
+	if (c->head != NO_SLOT)
+		c->entries[c->head].prev = slot;
+	c->head = slot;
+	if (c->tail == NO_SLOT)
+		c->tail = slot;
+}
+
+static int cache_writeback(struct disk *disk, int slot)
+{
+	struct block_cache *c = &disk->cache;
+	struct cache_entry *e = &c->entries[slot];
+
+	if (!e->dirty)
+		return 0;
+
+	if (raw_write(disk, e->block, e->data))
+		return -1;
+
+	e->dirty = 0;
+	c->ndirty--;
+	c->stats.writebacks++;
+
+	return 0;
+}
+
+/*
+ * Take the least recently used slot for @block, writing back its previous
+ * content if needed. The slot is returned at the head of the LRU list.
+ */
+static int cache_claim(struct disk *disk, size_t block)
+{
+	struct block_cache *c = &disk->cache;
+	int slot = c->tail;
+	struct cache_entry *e;
+
+	/* Pinned blocks stay where they are */
+	while (slot != NO_SLOT && c->entries[slot].pins)
+		slot = c->entries[slot].prev;
+	if (slot == NO_SLOT) {
+		block_error("every cached block is pinned");
+		return NO_SLOT;
+	}
+	e = &c->entries[slot];
+
+	if (e->used) {
+		if (cache_writeback(disk, slot))
+			return NO_SLOT;
+		cache_hash_remove(c, slot);
+		c->stats.evictions++;
+	}
+
+	e->block = block;
+	e->used = 1;
+	e->dirty = 0;
+	e->hnext = c->buckets[cache_hash(c, block)];
+	c->buckets[cache_hash(c, block)] = slot;
+
+	cache_lru_unlink(c, slot);
+	cache_lru_push(c, slot);
+
+	return slot;
+}
+
+static unsigned long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void cache_mark_dirty(struct block_cache *c, int slot)
+{
+	struct cache_entry *e = &c->entries[slot];
+
+	if (e->dirty)
+		return;
+
+	e->dirty = 1;
+	e->dirtied = now_ms();
+	c->ndirty++;
+}
+
+static int cache_wb_cmp(const void *a, const void *b)
+{
+	const struct cache_wb *x = a, *y = b;
+
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+/*
+ * Write back the blocks dirty for at least @age_ms, then the oldest others
+ * until at most @keep blocks remain dirty, but no more than @max blocks. The
+ * blocks are written in block order, consecutive blocks with a single
+ * transfer. Return the number of blocks written, or -1.
+ */
+static long cache_clean(struct disk *disk, unsigned long age_ms, size_t keep,
+			size_t max)
+{
+	struct block_cache *c = &disk->cache;
+	struct cache_wb *wb = c->wb;
+	struct iovec iov[WRITEBACK_BATCH];
+	unsigned long now = now_ms();
+	size_t n = 0, pick, i, j;
+
+	if (!c->ndirty)
+		return 0;
+
+	for (i = 0; i < c->size; i++) {
+		if (!c->entries[i].dirty)
+			continue;
+		wb[n].key = c->entries[i].dirtied;
+		wb[n].slot = i;
+		n++;
+	}
+
+	/* Oldest first: the expired blocks come before the others */
+	qsort(wb, n, sizeof(*wb), cache_wb_cmp);
+	for (pick = 0; pick < n && pick < max; pick++)
+		if (now - wb[pick].key < age_ms && n - pick <= keep)
+			break;
+
+	for (i = 0; i < pick; i++)
+		wb[i].key = c->entries[wb[i].slot].block;
+	qsort(wb, pick, sizeof(*wb), cache_wb_cmp);
+
+	for (i = 0; i < pick; i = j) {
+		size_t block = wb[i].key;
+
+		for (j = i; j < pick && j - i < WRITEBACK_BATCH
+			    && wb[j].key == block + (j - i); j++) {
+			iov[j - i].iov_base = c->entries[wb[j].slot].data;
+			iov[j - i].iov_len = disk->bsize;
+		}
+
+		if (raw_xferv(disk, 1, block, iov, j - i))
+			return -1;
+
+		for (size_t k = i; k < j; k++)
+			c->entries[wb[k].slot].dirty = 0;
+		c->ndirty -= j - i;
+		c->stats.writebacks += j - i;
+	}
+
+	return pick;
+}
+
+static int cache_flush(struct disk *disk)
+{
+	return cache_clean(disk, 0, 0, disk->cache.size) < 0 ? -1 : 0;
+}
+
+/*
+ * Make the writer which took the cache over the dirty limit write back the
+ * oldest half of what it allows
+ */
+static int cache_throttle(struct disk *disk)
+{
+	if (!disk->dirty_limit || disk->cache.ndirty <= disk->dirty_limit)
+		return 0;
+
+	return cache_clean(disk, ULONG_MAX, disk->dirty_limit / 2,
+			   disk->cache.size) < 0 ? -1 : 0;
+}
+
+/*
+ * Return the slot caching @block, claiming one if it isn't cached. A claimed
+ * slot is filled from the disk if @fill is set, and left for the caller to
+ * fill otherwise.
+ */
+static int cache_get(struct disk *disk, size_t block, int fill)
+{
+	struct block_cache *c = &disk->cache;
+	int slot;
+
+	slot = cache_lookup(c, block);
+	if (slot != NO_SLOT) {
+		c->stats.hits++;
+		io_stat_add(cache_hits, 1);
+		cache_lru_unlink(c, slot);
+		cache_lru_push(c, slot);
+		return slot;
+	}
+
+	c->stats.misses++;
+	io_stat_add(cache_misses, 1);
+	if ((slot = cache_claim(disk, block)) == NO_SLOT)
+		return NO_SLOT;
+	if (fill && raw_read(disk, block, c->entries[slot].data)) {
+		/* Leave the slot unused rather than holding garbage */
+		cache_hash_remove(c, slot);
+		c->entries[slot].used = 0;
+		return NO_SLOT;
+	}
+
+	return slot;
+}
+
+static void cache_destroy(struct block_cache *c)
+{
+	free(c->entries);
+	free(c->mem);
+	free(c->buckets);
+	free(c->wb);
+	c->entries = NULL;
+	c->mem = NULL;
+	c->buckets = NULL;
+	c->wb = NULL;
+	c->size = 0;
+}
+
+static int cache_create(struct block_cache *c, size_t size, size_t bsize)
+{
+	c->size = 0;
+	c->pinned = 0;
+	c->ndirty = 0;
+	c->head = c->tail = NO_SLOT;
+	if (!size)
+		return 0;
+
+	c->nbuckets = 1;
+	while (c->nbuckets < 2 * size)
+		c->nbuckets <<= 1;
+
+	c->entries = calloc(size, sizeof(struct cache_entry));
+	c->mem = malloc(size * bsize);
+	c->buckets = malloc(c->nbuckets * sizeof(int));
+	c->wb = malloc(size * sizeof(struct cache_wb));
+	if (!c->entries || !c->mem || !c->buckets || !c->wb) {
+		cache_destroy(c);
+		return -1;
+	}
+
+	for (size_t i = 0; i < c->nbuckets; i++)
+		c->buckets[i] = NO_SLOT;
+
+	for (size_t i = 0; i < size; i++) {
+		c->entries[i].data = c->mem + i * bsize;
+		c->entries[i].hnext = NO_SLOT;
+		cache_lru_push(c, i);
+	}
+	c->size = size;
+
+	return 0;
+}
+
+/*
+ * Number of blocks of @bsize bytes taking the memory of the requested cache
+ * size, in blocks of %BLOCK_SIZE bytes
+ */
+static size_t cache_blocks(size_t bsize)
+{
+	size_t n = cache_size * BLOCK_SIZE / bsize;
+
+	if (n < CACHE_MIN_BLOCKS)
+		n = cache_size < CACHE_MIN_BLOCKS ? cache_size : CACHE_MIN_BLOCKS;
+
+	return n;
+}
+
+struct disk *disk_open(const char *diskname, int flags)
+{
+	return disk_open_block_size(diskname, flags, BLOCK_SIZE);
+}
+
+struct disk *disk_open_block_size(const char *diskname, int flags,
+				  size_t block_size)
 {
+	struct disk *disk;
 	int fd;
 	struct stat st;
+	char *map = NULL;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
+		return NULL;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+	if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ||
+	    (block_size & (block_size - 1))) {
+		block_error("invalid block size '%zu'", block_size);
+		return NULL;
 	}
 
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (st.st_size % block_size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    st.st_size, block_size);
+		close(fd);
+		return NULL;
+	}
+
+	disk = calloc(1, sizeof(*disk));
+	if (!disk) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
+
+	if ((flags & BLOCK_DISK_MMAP) && st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			free(disk);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	/* The kernel's page cache already caches a mapped image */
+	if (cache_create(&disk->cache, map ? 0 : cache_blocks(block_size),
+			 block_size)) {
+		block_error("cannot allocate block cache");
+		if (map)
+			munmap(map, st.st_size);
+		free(disk);
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_init(&disk->lock, NULL);
+	pthread_cond_init(&disk->prefetch.cond, NULL);
+	disk->fd = fd;
+	disk->bcount = st.st_size / block_size;
+	disk->bsize = block_size;
+	disk->prefetch.max = PREFETCH_BYTES / block_size ?
+		PREFETCH_BYTES / block_size : 1;
+	disk->map = map;
+
+	return disk;
+}
+
+int disk_close(struct disk *disk)
+{
+	int ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* A disk that cannot be flushed stays open, engines included */
+	pthread_mutex_lock(&disk->lock);
+	ret = cache_flush(disk);
+	pthread_mutex_unlock(&disk->lock);
+	if (ret)
 		return -1;
+
+	if (disk->aio.backend != AIO_NONE)
+		disk_aio_teardown(disk);
+
+	prefetch_stop(disk);
+	cache_destroy(&disk->cache);
+
+	if (disk->map) {
+		if (msync(disk->map, disk->bcount * disk->bsize, MS_SYNC))
+			perror("msync");
+		munmap(disk->map, disk->bcount * disk->bsize);
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	close(disk->fd);
+	pthread_cond_destroy(&disk->prefetch.cond);
+	pthread_mutex_destroy(&disk->lock);
+	free(disk);
 
 	return 0;
 }
 
-int block_disk_close(void)
+int disk_sync(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk->map) {
+		if (msync(disk->map, disk->bcount * disk->bsize, MS_SYNC)) {
+			perror("msync");
+			return -1;
+		}
+		return 0;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	ret = cache_flush(disk);
+	pthread_mutex_unlock(&disk->lock);
+	if (ret)
+		return -1;
 
-	disk.fd = INVALID_FD;
+	if (fdatasync(disk->fd)) {
+		perror("fdatasync");
+		return -1;
+	}
 
 	return 0;
 }
 
-int block_disk_count(void)
+void *disk_map(struct disk *disk, size_t block)
+{
+	if (!disk || !disk->map || block >= disk->bcount)
+		return NULL;
+
+	return disk->map + block * disk->bsize;
+}
+
+int disk_block_size(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk->bsize;
 }
 
-int block_write(size_t block, const void *buf)
+int disk_count(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	return disk->bcount;
+}
+
+int disk_write(struct disk *disk, size_t block, const void *buf)
+{
+	struct block_cache *c;
+	int slot;
+
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	c = &disk->cache;
+
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
+	trace_xfer(disk, BLOCK_TRACE_WRITE, block, 1);
+
+	if (!c->size)
+		return raw_write(disk, block, buf);
+
+	/* A whole block is written, so a miss needs no read from disk */
+	pthread_mutex_lock(&disk->lock);
+	slot = cache_get(disk, block, 0);
+	if (slot != NO_SLOT) {
+		memcpy(c->entries[slot].data, buf, disk->bsize);
+		cache_mark_dirty(c, slot);
+		if (cache_throttle(disk))
+			slot = NO_SLOT;
 	}
+	pthread_mutex_unlock(&disk->lock);
 
-	return 0;
+	return slot == NO_SLOT ? -1 : 0;
 }
 
-int block_read(size_t block, void *buf)
+int disk_read(struct disk *disk, size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	struct block_cache *c;
+	int slot;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	c = &disk->cache;
+
+	if (block >= disk->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, disk->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
+	trace_xfer(disk, BLOCK_TRACE_READ, block, 1);
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
-		return -1;
-	}
+	if (!c->size)
+		return raw_read(disk, block, buf);
 
-	return 0;
+	pthread_mutex_lock(&disk->lock);
+	slot = cache_get(disk, block, 1);
+	if (slot != NO_SLOT)
+		memcpy(buf, c->entries[slot].data, disk->bsize);
+	pthread_mutex_unlock(&disk->lock);
+
+	return slot == NO_SLOT ? -1 : 0;
 }
 
+/*
+ * Return the @i-th slot to visit for blocks [@block, @block + @nblocks), or
+ * NO_SLOT if it caches none of them. Whichever of the range and the cache is
+ * smaller is walked, so @i goes up to the smaller of @nblocks and the cache
+ * size.
+ */
+static int cache_range_slot(struct block_cache *c, size_t block,
+			    size_t nblocks, size_t i)
+{
+	if (nblocks <= c->size)
+		return cache_lookup(c, block + i);
+
+	if (!c->entries[i].used || c->entries[i].block < block
+	    || c->entries[i].block >= block + nblocks)
+		return NO_SLOT;
+	return i;
+}
+
+/*
+ * Reconcile the cached copies of blocks [@block, @block + @nblocks) with a
+ * vectored transfer that bypassed the cache: dirty copies are newer than what
+ * a read brought in, and a write makes every copy stale.
+ */
+static void cache_sync_range(struct disk *disk, int write, size_t block,
+			     size_t nblocks, const struct iovec *iov)
+{
+	struct block_cache *c = &disk->cache;
+	struct cache_entry *e;
+	int slot;
+
+	for (size_t i = 0; i < nblocks && i < c->size; i++) {
+		if ((slot = cache_range_slot(c, block, nblocks, i)) == NO_SLOT)
+			continue;
+		e = &c->entries[slot];
+
+		if (write) {
+			block_iov_copy(0, iov, (e->block - block) * disk->bsize,
+				       e->data, disk->bsize);
+			if (e->dirty)
+				c->ndirty--;
+			e->dirty = 0;
+		} else if (e->dirty) {
+			block_iov_copy(1, iov, (e->block - block) * disk->bsize,
+				       e->data, disk->bsize);
+		}
+	}
+}
+
+/*
+ * Read blocks [@block, @block + @nblocks) into @iov: blocks held in the cache
+ * are copied from it, and each run of the others is read from the disk image
+ * with a single transfer.
+ */
+static int cache_readv(struct disk *disk, size_t block, size_t nblocks,
+		       const struct iovec *iov, int iovcnt)
+{
+	struct block_cache *c = &disk->cache;
+	struct iovec local[8], *sub = local;
+	size_t i = 0, j;
+	int slot, cnt, ret = 0;
+
+	if (iovcnt > (int)(sizeof(local) / sizeof(local[0]))) {
+		sub = malloc(iovcnt * sizeof(struct iovec));
+		if (!sub) {
+			perror("malloc");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	while (i < nblocks) {
+		slot = c->size ? cache_lookup(c, block + i) : NO_SLOT;
+		if (slot != NO_SLOT) {
+			block_iov_copy(1, iov, i * disk->bsize,
+				       c->entries[slot].data, disk->bsize);
+			c->stats.hits++;
+			io_stat_add(cache_hits, 1);
+			cache_lru_unlink(c, slot);
+			cache_lru_push(c, slot);
+			i++;
+			continue;
+		}
+
+		for (j = i + 1; j < nblocks; j++)
+			if (c->size && cache_lookup(c, block + j) != NO_SLOT)
+				break;
+
+		pthread_mutex_unlock(&disk->lock);
+		cnt = block_iov_slice(iov, i * disk->bsize,
+				      (j - i) * disk->bsize, sub);
+		ret = raw_xferv(disk, 0, block + i, sub, cnt);
+		pthread_mutex_lock(&disk->lock);
+		if (ret)
+			break;
+
+		/* Blocks dirtied meanwhile are newer than what was read */
+		cache_sync_range(disk, 0, block + i, j - i, sub);
+		i = j;
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	if (sub != local)
+		free(sub);
+
+	return ret;
+}
+
+/*
+ * Copy blocks [@block, @block + @nblocks) from @iov into the cache, leaving
+ * them dirty for a later write back
+ */
+static int cache_writev(struct disk *disk, size_t block, size_t nblocks,
+			const struct iovec *iov)
+{
+	struct block_cache *c = &disk->cache;
+	int slot, ret = 0;
+
+	pthread_mutex_lock(&disk->lock);
+	for (size_t i = 0; i < nblocks && !ret; i++) {
+		if ((slot = cache_get(disk, block + i, 0)) == NO_SLOT) {
+			ret = -1;
+			break;
+		}
+		block_iov_copy(0, iov, i * disk->bsize, c->entries[slot].data,
+			       disk->bsize);
+		cache_mark_dirty(c, slot);
+		ret = cache_throttle(disk);
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+static int block_xferv(struct disk *disk, int write, size_t block,
+		       const struct iovec *iov, int iovcnt)
+{
+	size_t len, nblocks;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	len = iov_length(iov, iovcnt);
+	if (len % disk->bsize != 0) {
+		block_error("length '%zu' is not multiple of '%zu'",
+			    len, disk->bsize);
+		return -1;
+	}
+	nblocks = len / disk->bsize;
+
+	if (block >= disk->bcount || nblocks > disk->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, nblocks, disk->bcount);
+		return -1;
+	}
+
+	if (!nblocks)
+		return 0;
+
+	trace_xfer(disk, write ? BLOCK_TRACE_WRITE : BLOCK_TRACE_READ, block,
+		   nblocks);
+
+	if (!write && disk->cache.size)
+		return cache_readv(disk, block, nblocks, iov, iovcnt);
+	if (write && disk->cache.size && disk->dirty_limit)
+		return cache_writev(disk, block, nblocks, iov);
+
+	if (raw_xferv(disk, write, block, iov, iovcnt))
+		return -1;
+
+	pthread_mutex_lock(&disk->lock);
+	cache_sync_range(disk, write, block, nblocks, iov);
+	pthread_mutex_unlock(&disk->lock);
+
+	return 0;
+}
+
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt)
+{
+	return block_xferv(disk, 1, block, iov, iovcnt);
+}
+
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+	       int iovcnt)
+{
+	return block_xferv(disk, 0, block, iov, iovcnt);
+}
+
+static void aio_queue_push(struct aio_queue *q, struct aio_req *req)
+{
+	req->next = NULL;
+	if (q->tail)
+		q->tail->next = req;
+	else
+		q->head = req;
+	q->tail = req;
+}
+
+static struct aio_req *aio_queue_pop(struct aio_queue *q)
+{
+	struct aio_req *req = q->head;
+
+	if (req) {
+		q->head = req->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+
+	return req;
+}
+
+static void aio_req_run(struct aio_req *req)
+{
+	req->result = raw_xferv(req->disk, req->write, req->block, req->iov,
+				req->iovcnt);
+}
+
+static void *aio_worker(void *arg)
+{
+	struct block_aio *aio = arg;
+	struct aio_req *req;
+
+	pthread_mutex_lock(&aio->lock);
+	for (;;) {
+		while (!aio->stop && !aio->pending.head)
+			pthread_cond_wait(&aio->work_cond, &aio->lock);
+		if (!(req = aio_queue_pop(&aio->pending)))
+			break;
+
+		/* Positional transfers need no lock */
+		pthread_mutex_unlock(&aio->lock);
+		aio_req_run(req);
+		pthread_mutex_lock(&aio->lock);
+
+		aio_queue_push(&aio->done, req);
+		pthread_cond_broadcast(&aio->done_cond);
+	}
+	pthread_mutex_unlock(&aio->lock);
+
+	return NULL;
+}
+
+static int ring_setup(struct aio_ring *r, unsigned int depth)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED)
+			goto err_sq;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_cq;
+
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+	return 0;
+
+err_cq:
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+err_sq:
+	munmap(r->sq_ptr, r->sq_size);
+err_close:
+	close(r->fd);
+	return -1;
+}
+
+static void ring_destroy(struct aio_ring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+}
+
+static int ring_submit(struct aio_ring *r, struct aio_req *req)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = req->disk->fd;
+	sqe->addr = (uintptr_t)req->iov;
+	sqe->len = req->iovcnt;
+	sqe->off = (off_t)req->block * req->disk->bsize;
+	sqe->user_data = (uintptr_t)req;
+	r->sq_array[idx] = idx;
+
+	if (req->write) {
+		io_stat_add(writes, req->nblocks);
+		io_stat_add(write_calls, 1);
+	} else {
+		io_stat_add(reads, req->nblocks);
+		io_stat_add(read_calls, 1);
+	}
+
+	/* Publish the entry before the new tail */
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0) {
+		if (errno != EINTR) {
+			perror("io_uring_enter");
+			/* Take the entry back, the kernel did not consume it */
+			__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Move the requests completed by the kernel to the done queue */
+static void ring_collect(struct block_aio *aio)
+{
+	struct aio_ring *r = &aio->ring;
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		struct aio_req *req = (struct aio_req *)(uintptr_t)cqe->user_data;
+
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			perror(req->write ? "pwritev" : "preadv");
+			req->result = -1;
+		} else if ((size_t)cqe->res < req->nblocks * req->disk->bsize) {
+			/* Short transfer: redo it synchronously */
+			aio_req_run(req);
+		} else {
+			req->result = 0;
+		}
+		aio_queue_push(&aio->done, req);
+		head++;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int disk_aio_setup(struct disk *disk, unsigned int depth, int flags)
+{
+	struct block_aio *aio;
+	int i;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	aio = &disk->aio;
+
+	if (aio->backend != AIO_NONE) {
+		block_error("asynchronous engine already set up");
+		return -1;
+	}
+
+	if (!depth) {
+		block_error("invalid queue depth");
+		return -1;
+	}
+
+	memset(aio, 0, sizeof(*aio));
+	aio->depth = depth;
+	pthread_mutex_init(&aio->lock, NULL);
+
+	/* Copies to and from a mapped disk don't block on I/O */
+	if (disk->map) {
+		aio->backend = AIO_SYNC;
+		return 0;
+	}
+
+	if (!(flags & BLOCK_AIO_THREADS) && !ring_setup(&aio->ring, depth)) {
+		aio->backend = AIO_URING;
+		return 0;
+	}
+
+	pthread_cond_init(&aio->work_cond, NULL);
+	pthread_cond_init(&aio->done_cond, NULL);
+	for (i = 0; i < AIO_THREADS; i++) {
+		if (pthread_create(&aio->threads[i], NULL, aio_worker, aio)) {
+			block_error("cannot create worker thread");
+			break;
+		}
+	}
+	if (i < AIO_THREADS) {
+		aio->stop = 1;
+		pthread_cond_broadcast(&aio->work_cond);
+		while (i--)
+			pthread_join(aio->threads[i], NULL);
+		pthread_mutex_destroy(&aio->lock);
+		return -1;
+	}
+	aio->backend = AIO_THREADS_POOL;
+
+	return 0;
+}
+
+/*
+ * In-flight data of write @req wins over cached copies. They stay dirty until
+ * the write completes, so that evicting one before then writes the same data
+ * rather than leaving the disk's stale copy to be read back. Called with the
+ * disk lock held.
+ */
+static void cache_write_inflight(struct disk *disk, struct aio_req *req)
+{
+	struct block_cache *c = &disk->cache;
+	struct cache_entry *e;
+	int slot;
+
+	for (size_t i = 0; i < req->nblocks && i < c->size; i++) {
+		slot = cache_range_slot(c, req->block, req->nblocks, i);
+		if (slot == NO_SLOT)
+			continue;
+		e = &c->entries[slot];
+		block_iov_copy(0, req->iov,
+			       (e->block - req->block) * disk->bsize, e->data,
+			       disk->bsize);
+		cache_mark_dirty(c, slot);
+	}
+	disk->prefetch.writes++;
+}
+
+/*
+ * Write @req completed: the cached copies which still hold its data are now
+ * on the disk. Those changed since are left dirty, and so is every copy if
+ * the write failed. Called with the disk lock held.
+ */
+static void cache_write_done(struct disk *disk, struct aio_req *req)
+{
+	struct block_cache *c = &disk->cache;
+	struct cache_entry *e;
+	char *buf = NULL;
+	int slot;
+
+	disk->prefetch.writes--;
+	__atomic_add_fetch(&disk->prefetch.gen, 1, __ATOMIC_RELEASE);
+
+	if (req->result)
+		return;
+
+	for (size_t i = 0; i < req->nblocks && i < c->size; i++) {
+		slot = cache_range_slot(c, req->block, req->nblocks, i);
+		if (slot == NO_SLOT || !c->entries[slot].dirty)
+			continue;
+		e = &c->entries[slot];
+
+		if (!buf && !(buf = malloc(disk->bsize)))
+			return;
+		block_iov_copy(0, req->iov,
+			       (e->block - req->block) * disk->bsize, buf,
+			       disk->bsize);
+		if (memcmp(buf, e->data, disk->bsize))
+			continue;
+		e->dirty = 0;
+		c->ndirty--;
+	}
+	free(buf);
+}
+
+static int block_submit_async(struct disk *disk, int write, size_t block,
+			      const struct iovec *iov, int iovcnt, void *user)
+{
+	struct block_aio *aio;
+	struct aio_req *req;
+	size_t len;
+	int ret;
+
+	if (!disk || disk->aio.backend == AIO_NONE) {
+		block_error("no asynchronous engine set up");
+		return -1;
+	}
+
+	aio = &disk->aio;
+
+	if (__atomic_load_n(&aio->inflight, __ATOMIC_RELAXED) == aio->depth)
+		return -1;
+
+	len = iov_length(iov, iovcnt);
+	if (len % disk->bsize != 0 || !len) {
+		block_error("length '%zu' is not a non-zero multiple of '%zu'",
+			    len, disk->bsize);
+		return -1;
+	}
+	if (block >= disk->bcount || len / disk->bsize > disk->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, len / disk->bsize, disk->bcount);
+		return -1;
+	}
+
+	trace_xfer(disk, (write ? BLOCK_TRACE_WRITE : BLOCK_TRACE_READ) |
+		   BLOCK_TRACE_ASYNC, block, len / disk->bsize);
+
+	req = malloc(sizeof(*req));
+	if (req)
+		req->iov = malloc(iovcnt * sizeof(struct iovec));
+	if (!req || !req->iov) {
+		free(req);
+		return -1;
+	}
+	memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+	req->iovcnt = iovcnt;
+	req->disk = disk;
+	req->write = write;
+	req->block = block;
+	req->nblocks = len / disk->bsize;
+	req->user = user;
+	req->result = 0;
+
+	/* Counted before it can complete, a reaper may already be waiting */
+	__atomic_add_fetch(&aio->inflight, 1, __ATOMIC_RELAXED);
+
+	if (aio->backend == AIO_URING && iovcnt <= IOV_MAX) {
+		/*
+		 * The submission can fail, so the cache only takes the data
+		 * once the kernel has the request. The lock is held from
+		 * before, so that no cached copy is written back over it.
+		 */
+		if (write)
+			pthread_mutex_lock(&disk->lock);
+		ret = ring_submit(&aio->ring, req);
+		if (write) {
+			if (!ret)
+				cache_write_inflight(disk, req);
+			pthread_mutex_unlock(&disk->lock);
+		}
+		if (ret) {
+			__atomic_sub_fetch(&aio->inflight, 1, __ATOMIC_RELAXED);
+			free(req->iov);
+			free(req);
+			return -1;
+		}
+	} else {
+		if (write) {
+			pthread_mutex_lock(&disk->lock);
+			cache_write_inflight(disk, req);
+			pthread_mutex_unlock(&disk->lock);
+		}
+
+		if (aio->backend == AIO_THREADS_POOL) {
+			pthread_mutex_lock(&aio->lock);
+			aio_queue_push(&aio->pending, req);
+			pthread_cond_signal(&aio->work_cond);
+			pthread_mutex_unlock(&aio->lock);
+		} else {
+			aio_req_run(req);
+			pthread_mutex_lock(&aio->lock);
+			aio_queue_push(&aio->done, req);
+			pthread_mutex_unlock(&aio->lock);
+		}
+	}
+
+	return 0;
+}
+
+int disk_writev_async(struct disk *disk, size_t block, const struct iovec *iov,
+		      int iovcnt, void *user)
+{
+	return block_submit_async(disk, 1, block, iov, iovcnt, user);
+}
+
+int disk_readv_async(struct disk *disk, size_t block, const struct iovec *iov,
+		     int iovcnt, void *user)
+{
+	return block_submit_async(disk, 0, block, iov, iovcnt, user);
+}
+
+int disk_aio_reap(struct disk *disk, struct block_aio_event *events, int max,
+		  int min)
+{
+	struct block_aio *aio;
+	struct aio_req *req;
+	int n = 0;
+
+	if (!disk || disk->aio.backend == AIO_NONE) {
+		block_error("no asynchronous engine set up");
+		return -1;
+	}
+
+	aio = &disk->aio;
+
+	if (min > max)
+		min = max;
+	if ((unsigned int)min > __atomic_load_n(&aio->inflight, __ATOMIC_RELAXED))
+		min = __atomic_load_n(&aio->inflight, __ATOMIC_RELAXED);
+
+	while (n < max) {
+		if (aio->backend == AIO_THREADS_POOL) {
+			pthread_mutex_lock(&aio->lock);
+			while (n < min && !aio->done.head)
+				pthread_cond_wait(&aio->done_cond, &aio->lock);
+			req = aio_queue_pop(&aio->done);
+			pthread_mutex_unlock(&aio->lock);
+		} else {
+			pthread_mutex_lock(&aio->lock);
+			if (aio->backend == AIO_URING && !aio->done.head)
+				ring_collect(aio);
+			req = aio_queue_pop(&aio->done);
+			pthread_mutex_unlock(&aio->lock);
+
+			/* Submissions can go on while waiting */
+			if (!req && n < min && aio->backend == AIO_URING) {
+				syscall(__NR_io_uring_enter, aio->ring.fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+				continue;
+			}
+		}
+		if (!req)
+			break;
+
+		/* Blocks dirty in the cache are newer than what was read */
+		pthread_mutex_lock(&disk->lock);
+		if (req->write) {
+			cache_write_done(disk, req);
+		} else if (!req->result) {
+			cache_sync_range(disk, 0, req->block, req->nblocks,
+					 req->iov);
+		}
+		pthread_mutex_unlock(&disk->lock);
+
+		events[n].user = req->user;
+		events[n].result = req->result;
+		n++;
+		__atomic_sub_fetch(&aio->inflight, 1, __ATOMIC_RELAXED);
+		free(req->iov);
+		free(req);
+	}
+
+	return n;
+}
+
+int disk_aio_teardown(struct disk *disk)
+{
+	struct block_aio *aio;
+	struct block_aio_event ev;
+
+	if (!disk || disk->aio.backend == AIO_NONE) {
+		block_error("no asynchronous engine set up");
+		return -1;
+	}
+
+	aio = &disk->aio;
+
+	/* Wait for the requests in flight, their completions are lost */
+	while (__atomic_load_n(&aio->inflight, __ATOMIC_RELAXED))
+		disk_aio_reap(disk, &ev, 1, 1);
+
+	if (aio->backend == AIO_URING) {
+		ring_destroy(&aio->ring);
+	} else if (aio->backend == AIO_THREADS_POOL) {
+		pthread_mutex_lock(&aio->lock);
+		aio->stop = 1;
+		pthread_cond_broadcast(&aio->work_cond);
+		pthread_mutex_unlock(&aio->lock);
+		for (int i = 0; i < AIO_THREADS; i++)
+			pthread_join(aio->threads[i], NULL);
+		pthread_cond_destroy(&aio->work_cond);
+		pthread_cond_destroy(&aio->done_cond);
+	}
+	pthread_mutex_destroy(&aio->lock);
+	aio->backend = AIO_NONE;
+
+	return 0;
+}
+
+const void *disk_pin(struct disk *disk, size_t block)
+{
+	struct block_cache *c;
+	int slot;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	c = &disk->cache;
+
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
+		return NULL;
+	}
+
+	trace_xfer(disk, BLOCK_TRACE_READ, block, 1);
+
+	/* Mapped blocks stay valid until the disk is closed */
+	if (disk->map)
+		return disk->map + block * disk->bsize;
+
+	if (!c->size) {
+		block_error("no block cache to pin blocks in");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	slot = cache_get(disk, block, 1);
+	if (slot != NO_SLOT && !c->entries[slot].pins++)
+		c->pinned++;
+	pthread_mutex_unlock(&disk->lock);
+
+	return slot == NO_SLOT ? NULL : c->entries[slot].data;
+}
+
+int disk_unpin(struct disk *disk, size_t block)
+{
+	struct block_cache *c;
+	int slot;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	c = &disk->cache;
+
+	if (disk->map)
+		return 0;
+
+	pthread_mutex_lock(&disk->lock);
+	slot = c->size ? cache_lookup(c, block) : NO_SLOT;
+	if (slot == NO_SLOT || !c->entries[slot].pins) {
+		pthread_mutex_unlock(&disk->lock);
+		block_error("block %zu is not pinned", block);
+		return -1;
+	}
+
+	if (!--c->entries[slot].pins)
+		c->pinned--;
+	pthread_mutex_unlock(&disk->lock);
+
+	return 0;
+}
+
+/*
+ * Read the blocks of [@block, @block + @nblocks) missing from the cache into
+ * it. What is read is dropped if a write may have reached the disk image in
+ * the meantime, since it could be older than the disk's content.
+ */
+static void prefetch_range(struct disk *disk, size_t block, size_t nblocks)
+{
+	struct block_cache *c = &disk->cache;
+	struct block_prefetch *pf = &disk->prefetch;
+	struct iovec iov;
+	unsigned long gen;
+	size_t i = 0, n;
+	int slot, ret;
+
+	pthread_mutex_lock(&disk->lock);
+	while (i < nblocks && c->size) {
+		if (cache_lookup(c, block + i) != NO_SLOT) {
+			i++;
+			continue;
+		}
+
+		for (n = 1; i + n < nblocks && n < pf->max; n++)
+			if (cache_lookup(c, block + i + n) != NO_SLOT)
+				break;
+
+		gen = __atomic_load_n(&pf->gen, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&disk->lock);
+		iov.iov_base = pf->buf;
+		iov.iov_len = n * disk->bsize;
+		ret = raw_xferv(disk, 0, block + i, &iov, 1);
+		pthread_mutex_lock(&disk->lock);
+
+		if (ret || pf->writes
+		    || gen != __atomic_load_n(&pf->gen, __ATOMIC_ACQUIRE))
+			break;
+
+		for (size_t k = 0; k < n && c->size; k++) {
+			/* Cached meanwhile, and possibly dirty */
+			if (cache_lookup(c, block + i + k) != NO_SLOT)
+				continue;
+			if ((slot = cache_claim(disk, block + i + k)) == NO_SLOT)
+				break;
+			memcpy(c->entries[slot].data, pf->buf + k * disk->bsize,
+			       disk->bsize);
+			c->stats.prefetched++;
+		}
+		i += n;
+	}
+	pthread_mutex_unlock(&disk->lock);
+}
+
+static void *prefetch_worker(void *arg)
+{
+	struct disk *disk = arg;
+	struct block_prefetch *pf = &disk->prefetch;
+	size_t block, nblocks;
+
+	pthread_mutex_lock(&disk->lock);
+	for (;;) {
+		while (!pf->count && !pf->stop)
+			pthread_cond_wait(&pf->cond, &disk->lock);
+		if (pf->stop)
+			break;
+
+		block = pf->block[pf->head];
+		nblocks = pf->nblocks[pf->head];
+		pf->head = (pf->head + 1) % PREFETCH_QUEUE;
+		pf->count--;
+
+		pthread_mutex_unlock(&disk->lock);
+		prefetch_range(disk, block, nblocks);
+		pthread_mutex_lock(&disk->lock);
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	return NULL;
+}
+
+/* Stop the prefetch thread, dropping the ranges it has queued */
+static void prefetch_stop(struct disk *disk)
+{
+	struct block_prefetch *pf = &disk->prefetch;
+
+	if (!pf->running)
+		return;
+
+	pthread_mutex_lock(&disk->lock);
+	pf->stop = 1;
+	pthread_cond_signal(&pf->cond);
+	pthread_mutex_unlock(&disk->lock);
+	pthread_join(pf->thread, NULL);
+
+	free(pf->buf);
+	pf->buf = NULL;
+	pf->running = 0;
+	pf->stop = 0;
+	pf->count = 0;
+}
+
+int disk_prefetch(struct disk *disk, size_t block, size_t nblocks)
+{
+	struct block_prefetch *pf;
+	int ret = 0;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pf = &disk->prefetch;
+
+	if (block >= disk->bcount || nblocks > disk->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, nblocks, disk->bcount);
+		return -1;
+	}
+
+	if (!nblocks)
+		return 0;
+
+	trace_xfer(disk, BLOCK_TRACE_PREFETCH, block, nblocks);
+
+	/*
+	 * The kernel reads a mapped image ahead when told to, in whole pages
+	 * which small blocks don't fill. A hint it refuses is only ignored.
+	 */
+	if (disk->map) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t start = block * disk->bsize;
+		size_t end = start + nblocks * disk->bsize;
+
+		start -= start % page;
+		end += (page - end % page) % page;
+		madvise(disk->map + start, end - start, MADV_WILLNEED);
+		return 0;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+
+	/* A longer range would evict its own beginning before it is used */
+	if (nblocks > disk->cache.size / 2)
+		nblocks = disk->cache.size / 2;
+
+	if (nblocks && !pf->running) {
+		pf->buf = malloc(pf->max * disk->bsize);
+		if (!pf->buf
+		    || pthread_create(&pf->thread, NULL, prefetch_worker, disk)) {
+			block_error("cannot start prefetch thread");
+			free(pf->buf);
+			pf->buf = NULL;
+			ret = -1;
+		} else {
+			pf->running = 1;
+		}
+	}
+
+	/* Requests are hints, they are dropped when the queue is full */
+	if (nblocks && pf->running && pf->count < PREFETCH_QUEUE) {
+		unsigned int tail = (pf->head + pf->count) % PREFETCH_QUEUE;
+
+		pf->block[tail] = block;
+		pf->nblocks[tail] = nblocks;
+		pf->count++;
+		pthread_cond_signal(&pf->cond);
+	}
+
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+int disk_cache_resize(struct disk *disk, size_t nblocks)
+{
+	int ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk->map)
+		return 0;
+
+	pthread_mutex_lock(&disk->lock);
+	if (disk->cache.pinned) {
+		block_error("cannot resize cache with pinned blocks");
+		ret = -1;
+	} else if (!(ret = cache_flush(disk))) {
+		cache_destroy(&disk->cache);
+		if ((ret = cache_create(&disk->cache, nblocks, disk->bsize)))
+			block_error("cannot allocate block cache");
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+int disk_cache_flush(struct disk *disk)
+{
+	int ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	ret = cache_flush(disk);
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+long disk_writeback(struct disk *disk, unsigned int age_ms, size_t keep)
+{
+	long n, total = 0;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Let other users of the cache in between batches */
+	do {
+		pthread_mutex_lock(&disk->lock);
+		n = cache_clean(disk, age_ms, keep, WRITEBACK_BATCH);
+		pthread_mutex_unlock(&disk->lock);
+		if (n < 0)
+			return -1;
+		total += n;
+	} while (n == WRITEBACK_BATCH);
+
+	return total;
+}
+
+int disk_dirty_limit(struct disk *disk, size_t nblocks)
+{
+	int ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	disk->dirty_limit = nblocks;
+	ret = cache_throttle(disk);
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+int disk_cache_stats(struct disk *disk, struct block_cache_stats *stats)
+{
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	*stats = disk->cache.stats;
+	stats->dirty = disk->cache.ndirty;
+	stats->size = disk->cache.size;
+	pthread_mutex_unlock(&disk->lock);
+
+	return 0;
+}
+
+int block_io_stats(struct block_io_stats *stats)
+{
+#ifndef NO_STATS
+	stats->reads = __atomic_load_n(&io_stats.reads, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&io_stats.writes, __ATOMIC_RELAXED);
+	stats->read_calls = __atomic_load_n(&io_stats.read_calls,
+					    __ATOMIC_RELAXED);
+	stats->write_calls = __atomic_load_n(&io_stats.write_calls,
+					     __ATOMIC_RELAXED);
+	stats->cache_hits = __atomic_load_n(&io_stats.cache_hits,
+					    __ATOMIC_RELAXED);
+	stats->cache_misses = __atomic_load_n(&io_stats.cache_misses,
+					      __ATOMIC_RELAXED);
+	return 0;
+#else
+	memset(stats, 0, sizeof(*stats));
+	return -1;
+#endif
+}
+
+void block_io_stats_reset(void)
+{
+#ifndef NO_STATS
+	__atomic_store_n(&io_stats.reads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&io_stats.writes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&io_stats.read_calls, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&io_stats.write_calls, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&io_stats.cache_hits, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&io_stats.cache_misses, 0, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Write the buffered trace records, stopping the trace on failure */
+static int trace_flush(void)
+{
+	size_t len = trace.count * sizeof(struct block_trace_rec), done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = write(trace.fd, (char *)trace.buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("write");
+			close(trace.fd);
+			trace.fd = -1;
+			__atomic_store_n(&trace.on, 0, __ATOMIC_RELAXED);
+			return -1;
+		}
+		done += n;
+	}
+	trace.count = 0;
+
+	return 0;
+}
+
+static void trace_record(int op, size_t bsize, size_t block, size_t nblocks)
+{
+	struct block_trace_rec *rec;
+	struct timespec ts;
+	size_t n;
+
+	pthread_mutex_lock(&trace.lock);
+	/* The header written at start assumed the default block size */
+	if (trace.fd >= 0 && !trace.bsize) {
+		struct block_trace_header hdr = {
+			.magic = BLOCK_TRACE_MAGIC,
+			.version = BLOCK_TRACE_VERSION,
+			.block_size = bsize,
+		};
+
+		trace.bsize = bsize;
+		if (bsize != BLOCK_SIZE &&
+		    pwrite(trace.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			perror("pwrite");
+	}
+	/* Block numbers of another block size would not make sense */
+	if (bsize != trace.bsize)
+		nblocks = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/* Longer transfers than a record describes take several records */
+	while (trace.fd >= 0 && nblocks) {
+		if (trace.count == TRACE_BUFFER && trace_flush())
+			break;
+		n = nblocks > UINT16_MAX ? UINT16_MAX : nblocks;
+		rec = &trace.buf[trace.count++];
+		rec->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec -
+			trace.start;
+		rec->block = block;
+		rec->nblocks = n;
+		rec->op = op;
+		rec->tag = trace_tag;
+		block += n;
+		nblocks -= n;
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+int block_trace_start(const char *path)
+{
+	struct block_trace_header hdr = {
+		.magic = BLOCK_TRACE_MAGIC,
+		.version = BLOCK_TRACE_VERSION,
+		.block_size = BLOCK_SIZE,
+	};
+	struct timespec ts;
+	int ret = -1;
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.fd >= 0) {
+		block_error("a trace is already running");
+		goto out;
+	}
+
+	trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace.fd < 0) {
+		perror("open");
+		goto out;
+	}
+	if (write(trace.fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		perror("write");
+		close(trace.fd);
+		trace.fd = -1;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	trace.start = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	trace.count = 0;
+	trace.bsize = 0;
+	__atomic_store_n(&trace.on, 1, __ATOMIC_RELAXED);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&trace.lock);
+	return ret;
+}
+
+int block_trace_stop(void)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.fd < 0)
+		goto out;
+
+	__atomic_store_n(&trace.on, 0, __ATOMIC_RELAXED);
+	if (trace_flush())
+		goto out;
+	if (close(trace.fd))
+		perror("close");
+	else
+		ret = 0;
+	trace.fd = -1;
+out:
+	pthread_mutex_unlock(&trace.lock);
+	return ret;
+}
+
+void block_trace_tag(int tag)
+{
+	trace_tag = tag;
+}
+
+/*
+ * Single disk interface, operating on the disk opened with block_disk_open()
+ */
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
+{
+	if (cur_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	cur_disk = disk_open(diskname, flags);
+
+	return cur_disk ? 0 : -1;
+}
+
+int block_disk_close(void)
+{
+	if (disk_close(cur_disk))
+		return -1;
+
+	cur_disk = NULL;
+
+	return 0;
+}
+
+int block_disk_sync(void)
+{
+	return disk_sync(cur_disk);
+}
+
+void *block_map(size_t block)
+{
+	return disk_map(cur_disk, block);
+}
+
+int block_disk_count(void)
+{
+	return disk_count(cur_disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return disk_write(cur_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return disk_read(cur_disk, block, buf);
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return disk_writev(cur_disk, block, iov, iovcnt);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return disk_readv(cur_disk, block, iov, iovcnt);
+}
+
+int block_aio_setup(unsigned int depth, int flags)
+{
+	return disk_aio_setup(cur_disk, depth, flags);
+}
+
+int block_aio_teardown(void)
+{
+	return disk_aio_teardown(cur_disk);
+}
+
+int block_writev_async(size_t block, const struct iovec *iov, int iovcnt,
+		       void *user)
+{
+	return disk_writev_async(cur_disk, block, iov, iovcnt, user);
+}
+
+int block_readv_async(size_t block, const struct iovec *iov, int iovcnt,
+		      void *user)
+{
+	return disk_readv_async(cur_disk, block, iov, iovcnt, user);
+}
+
+int block_aio_reap(struct block_aio_event *events, int max, int min)
+{
+	return disk_aio_reap(cur_disk, events, max, min);
+}
+
+const void *block_pin(size_t block)
+{
+	return disk_pin(cur_disk, block);
+}
+
+int block_unpin(size_t block)
+{
+	return disk_unpin(cur_disk, block);
+}
+
+int block_prefetch(size_t block, size_t nblocks)
+{
+	return disk_prefetch(cur_disk, block, nblocks);
+}
+
+int block_cache_resize(size_t nblocks)
+{
+	if (cur_disk && disk_cache_resize(cur_disk, nblocks))
+		return -1;
+
+	cache_size = nblocks;
+	return 0;
+}
+
+int block_cache_flush(void)
+{
+	return disk_cache_flush(cur_disk);
+}
+
+long block_writeback(unsigned int age_ms, size_t keep)
+{
+	return disk_writeback(cur_disk, age_ms, keep);
+}
+
+int block_dirty_limit(size_t nblocks)
+{
+	return disk_dirty_limit(cur_disk, nblocks);
+}
+
+int block_cache_stats(struct block_cache_stats *stats)
+{
+	return disk_cache_stats(cur_disk, stats);
+}
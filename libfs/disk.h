@@ -2,10 +2,123 @@
 #define _DISK_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, unless set by disk_open_block_size() */
 #define BLOCK_SIZE 4096
 
+/** Smallest and largest block sizes, see disk_open_block_size() */
+#define BLOCK_SIZE_MIN 1024
+#define BLOCK_SIZE_MAX (1024 * 1024)
+
+/** Map the whole virtual disk file in memory, see block_disk_open_flags() */
+#define BLOCK_DISK_MMAP 0x1
+
+/** Use worker threads even if io_uring is available, see block_aio_setup() */
+#define BLOCK_AIO_THREADS 0x1
+
+/** Default number of blocks held by the block cache */
+#define BLOCK_CACHE_DEFAULT 256
+
+/** First bytes of a trace file, see block_trace_start() */
+#define BLOCK_TRACE_MAGIC "BLKTRACE"
+
+/** Version of the trace file format */
+#define BLOCK_TRACE_VERSION 1
+
+/** Kinds of traced transfers, in the low bits of &struct block_trace_rec.op */
+enum block_trace_op {
+	BLOCK_TRACE_READ,
+	BLOCK_TRACE_WRITE,
+	BLOCK_TRACE_PREFETCH,
+};
+
+/** Flag of traced transfers submitted to the asynchronous engine */
+#define BLOCK_TRACE_ASYNC 0x80
+
+/**
+ * struct block_trace_header - Start of a trace file
+ * @magic: %BLOCK_TRACE_MAGIC, not NULL-terminated
+ * @version: %BLOCK_TRACE_VERSION
+ * @block_size: Size of a block in bytes, that of the first disk traced
+ */
+struct block_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+};
+
+/**
+ * struct block_trace_rec - Traced transfer, following the header of a trace
+ * file
+ * @time_ns: Time of the request, in ns since the trace started
+ * @block: First block transferred
+ * @nblocks: Number of blocks transferred
+ * @op: Kind of transfer, from enum block_trace_op, or'ed with
+ *      %BLOCK_TRACE_ASYNC if it was submitted asynchronously
+ * @tag: Label set with block_trace_tag() by the requesting thread
+ */
+struct block_trace_rec {
+	uint64_t time_ns;
+	uint32_t block;
+	uint16_t nblocks;
+	uint8_t op;
+	uint8_t tag;
+};
+
+/**
+ * struct block_cache_stats - Block cache counters
+ * @hits: Accesses served from the cache
+ * @misses: Accesses that had to allocate a cache slot
+ * @evictions: Blocks dropped from the cache to make room for others
+ * @writebacks: Dirty blocks written to the disk image
+ * @prefetched: Blocks read into the cache by block_prefetch()
+ * @dirty: Blocks currently dirty in the cache
+ * @size: Number of blocks the cache can hold
+ */
+struct block_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t prefetched;
+	size_t dirty;
+	size_t size;
+};
+
+/**
+ * struct block_io_stats - Transfer counters of every open disk
+ * @reads: Blocks read from virtual disk files
+ * @writes: Blocks written to virtual disk files
+ * @read_calls: Read transfers, each a system call or a copy from a mapping
+ * @write_calls: Write transfers
+ * @cache_hits: Blocks found in a block cache
+ * @cache_misses: Blocks that had to allocate a cache slot
+ */
+struct block_io_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_calls;
+	uint64_t write_calls;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+};
+
+/*
+ * Two interfaces are available. The block_*() functions operate on a single
+ * virtual disk file, opened with block_disk_open(). The disk_*() functions
+ * take the disk they operate on, opened with disk_open(), so that several
+ * virtual disk files can be open at the same time.
+ *
+ * Block transfers on a disk can be issued from several threads at the same
+ * time: the block cache is protected by a lock, and transfers that bypass it
+ * use positional I/O. Concurrent transfers to the same block are not ordered.
+ * Opening and closing a disk, and setting up or tearing down its asynchronous
+ * engine, must not race with other calls on that disk.
+ */
+struct disk;
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +132,21 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_flags - Open virtual disk file with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of options
+ *
+ * Same as block_disk_open(), with options. If @flags contains
+ * %BLOCK_DISK_MMAP, the whole virtual disk file is mapped in memory: block
+ * transfers become memory copies, the kernel's page cache replaces the block
+ * cache, and block_map() gives direct access to the blocks.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or if a disk is already open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +154,32 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Make written blocks durable
+ *
+ * Write the dirty blocks of the block cache to the virtual disk file and wait
+ * until the file's data reaches the storage device (msync() for a mapped
+ * disk).
+ *
+ * Return: -1 if there was no virtual disk file opened or if writing fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
+/**
+ * block_map - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Return a pointer to the %BLOCK_SIZE bytes of block @block in the mapping of
+ * a disk opened with %BLOCK_DISK_MMAP. Consecutive blocks are consecutive in
+ * memory. Writes through the pointer modify the virtual disk file. The pointer
+ * is valid until the disk is closed.
+ *
+ * Return: NULL if there is no mapped disk open or if @block is out of bounds.
+ * Otherwise, a pointer to the block's content.
+ */
+void *block_map(size_t block);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,5 +214,422 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @iov: Data buffers to write in the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the content of the @iovcnt buffers described by @iov, in order, in the
+ * virtual disk's blocks starting at @block. The total length of the buffers
+ * must be a multiple of %BLOCK_SIZE, but an individual buffer can span several
+ * blocks or part of a block. The blocks are transferred with a single
+ * positional system call when possible and do not go through the block cache,
+ * although cached copies of the blocks are kept up to date. Once a dirty limit
+ * is set with block_dirty_limit(), they are copied into the cache instead.
+ *
+ * Return: -1 if the blocks are out of bounds or inaccessible, if the total
+ * length is not a multiple of %BLOCK_SIZE or if the writing operation fails. 0
+ * otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @iov: Data buffers to be filled with content of the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the content of the virtual disk's blocks starting at @block into the
+ * @iovcnt buffers described by @iov, in order. Same rules as block_writev()
+ * apply; blocks held in the block cache are copied from the cache, and each run
+ * of the other blocks is read with a single positional system call.
+ *
+ * Return: -1 if the blocks are out of bounds or inaccessible, if the total
+ * length is not a multiple of %BLOCK_SIZE or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_iov_copy - Copy bytes between a buffer and a vector of buffers
+ * @to_iov: Copy from @buf into the buffers if set, the other way otherwise
+ * @iov: Buffers, which must hold at least @off + @len bytes
+ * @off: Offset of the bytes to copy in the buffers described by @iov
+ * @buf: Contiguous buffer of @len bytes
+ * @len: Number of bytes to copy
+ */
+void block_iov_copy(int to_iov, const struct iovec *iov, size_t off, void *buf,
+		    size_t len);
+
+/**
+ * block_iov_slice - Describe part of a vector of buffers
+ * @iov: Buffers, which must hold at least @off + @len bytes
+ * @off: Offset of the part in the buffers described by @iov
+ * @len: Length of the part
+ * @out: Filled with the buffers describing the part, it needs one entry per
+ * buffer of @iov the part touches
+ *
+ * Return: the number of entries filled in @out.
+ */
+int block_iov_slice(const struct iovec *iov, size_t off, size_t len,
+		    struct iovec *out);
+
+/**
+ * struct block_aio_event - Completion of an asynchronous block transfer
+ * @user: Cookie given when the transfer was submitted
+ * @result: 0 if the transfer succeeded, -1 otherwise
+ */
+struct block_aio_event {
+	void *user;
+	int result;
+};
+
+/**
+ * block_aio_setup - Start the asynchronous block engine
+ * @depth: Maximum number of transfers submitted and not reaped yet
+ * @flags: Bitwise or of options
+ *
+ * Prepare the currently open disk for block_readv_async() and
+ * block_writev_async(). Transfers are handed to an io_uring instance when the
+ * kernel provides one, and to a pool of worker threads otherwise or if @flags
+ * contains %BLOCK_AIO_THREADS. Transfers to a disk opened with
+ * %BLOCK_DISK_MMAP are performed at submission time. Submissions must not run
+ * concurrently with each other, nor reaping with reaping, but one thread can
+ * reap, and wait for completions, while another submits. The engine is torn
+ * down when the disk is closed.
+ *
+ * Return: -1 if there was no virtual disk file opened, if the engine is already
+ * set up, if @depth is 0, or if the engine cannot be started. 0 otherwise.
+ */
+int block_aio_setup(unsigned int depth, int flags);
+
+/**
+ * block_aio_teardown - Stop the asynchronous block engine
+ *
+ * Wait for the transfers in flight, discard their completions and release the
+ * engine's resources.
+ *
+ * Return: -1 if the engine is not set up. 0 otherwise.
+ */
+int block_aio_teardown(void);
+
+/**
+ * block_writev_async - Submit a write of consecutive blocks
+ * @block: Index of the first block to write to
+ * @iov: Data buffers to write in the blocks
+ * @iovcnt: Number of buffers in @iov
+ * @user: Cookie returned with the completion
+ *
+ * Asynchronous version of block_writev(). The buffers must stay valid and
+ * unchanged until the completion is returned by block_aio_reap(), but the
+ * array @iov itself can be reused right away. Cached copies of the blocks are
+ * updated at submission time. Transfers in flight at the same time are not
+ * ordered with respect to each other.
+ *
+ * Return: -1 if the engine is not set up, if @depth transfers are already in
+ * flight, or if the blocks or the length are invalid. 0 otherwise.
+ */
+int block_writev_async(size_t block, const struct iovec *iov, int iovcnt,
+		       void *user);
+
+/**
+ * block_readv_async - Submit a read of consecutive blocks
+ * @block: Index of the first block to read from
+ * @iov: Data buffers to be filled with content of the blocks
+ * @iovcnt: Number of buffers in @iov
+ * @user: Cookie returned with the completion
+ *
+ * Asynchronous version of block_readv(), same rules as block_writev_async()
+ * apply. The buffers are only guaranteed to hold the blocks' content once the
+ * completion is returned by block_aio_reap().
+ *
+ * Return: -1 if the engine is not set up, if @depth transfers are already in
+ * flight, or if the blocks or the length are invalid. 0 otherwise.
+ */
+int block_readv_async(size_t block, const struct iovec *iov, int iovcnt,
+		      void *user);
+
+/**
+ * block_aio_reap - Collect completed asynchronous transfers
+ * @events: Array to fill with completions
+ * @max: Size of @events
+ * @min: Number of completions to wait for
+ *
+ * Return up to @max completions, waiting until at least @min of them are
+ * available (or until every transfer in flight has completed).
+ *
+ * Return: -1 if the engine is not set up. Otherwise, the number of completions
+ * stored in @events.
+ */
+int block_aio_reap(struct block_aio_event *events, int max, int min);
+
+/**
+ * block_pin - Get direct access to a block's content
+ * @block: Index of the block
+ *
+ * Return a pointer to the content of block @block, which stays valid until a
+ * matching call to block_unpin(). For a disk opened with %BLOCK_DISK_MMAP, the
+ * pointer is the same as block_map()'s. Otherwise, the block is read into the
+ * block cache if needed and is not evicted while it is pinned. The content
+ * must not be modified through the pointer, but it reflects later calls to
+ * block_write() and block_writev() on the block.
+ *
+ * Return: NULL if there was no virtual disk file opened, if @block is out of
+ * bounds, if the reading operation fails, or if there is no cache slot
+ * available (the cache is disabled or all its blocks are pinned). Otherwise, a
+ * pointer to the block's %BLOCK_SIZE bytes.
+ */
+const void *block_pin(size_t block);
+
+/**
+ * block_unpin - Release access to a block's content
+ * @block: Index of a block returned by block_pin()
+ *
+ * Return: -1 if there was no virtual disk file opened or if @block is not
+ * pinned. 0 otherwise.
+ */
+int block_unpin(size_t block);
+
+/**
+ * block_prefetch - Read blocks ahead of their use
+ * @block: Index of the first block to read
+ * @nblocks: Number of blocks to read
+ *
+ * Hint that blocks [@block, @block + @nblocks) will be read soon. They are read
+ * into the block cache by a background thread, started by the first call, so
+ * that later calls to block_read() and block_readv() find them there. At most
+ * half of the cache is read ahead at once, and hints are dropped when the
+ * thread is too far behind. For a disk opened with %BLOCK_DISK_MMAP, the
+ * kernel is asked to read the blocks into the page cache instead.
+ *
+ * Return: -1 if there was no virtual disk file opened, if the blocks are out
+ * of bounds, or if the background thread cannot be started. 0 otherwise.
+ */
+int block_prefetch(size_t block, size_t nblocks);
+
+/**
+ * block_cache_resize - Set the size of the block cache
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Blocks read with block_read() and written with block_write() are kept in a
+ * write-back cache with least recently used replacement. Dirty blocks reach the
+ * virtual disk file when they are evicted, when block_cache_flush() or
+ * block_disk_sync() is called or when the disk is closed. A size of 0 disables
+ * the cache. The new size applies immediately if a disk is open (the current
+ * content of the cache is flushed first) and to every disk opened afterwards,
+ * except disks opened with %BLOCK_DISK_MMAP which are never cached. The
+ * default size is %BLOCK_CACHE_DEFAULT blocks. A disk opened afterwards with
+ * another block size than %BLOCK_SIZE gets a cache of as many bytes, but of
+ * no fewer than 16 blocks unless @nblocks is smaller.
+ *
+ * Return: -1 if the cache cannot be flushed or allocated, or if some of its
+ * blocks are pinned. 0 otherwise.
+ */
+int block_cache_resize(size_t nblocks);
+
+/**
+ * block_cache_flush - Write dirty cached blocks to disk
+ *
+ * Return: -1 if there was no virtual disk file opened or if a write fails. 0
+ * otherwise.
+ */
+int block_cache_flush(void);
+
+/**
+ * block_writeback - Write back dirty cached blocks
+ * @age_ms: Age, in milliseconds, from which a dirty block is written back
+ * @keep: Number of dirty blocks which can stay in the cache
+ *
+ * Write back the blocks which have been dirty for at least @age_ms, then the
+ * oldest other dirty blocks until at most @keep remain. Blocks are written in
+ * block order, and consecutive blocks with a single transfer. The cache stays
+ * usable by other threads between batches of writes.
+ *
+ * Return: -1 if there was no virtual disk file opened or if a write fails.
+ * Otherwise, the number of blocks written.
+ */
+long block_writeback(unsigned int age_ms, size_t keep);
+
+/**
+ * block_dirty_limit - Bound the amount of dirty data in the block cache
+ * @nblocks: Number of dirty blocks allowed, 0 for no limit
+ *
+ * With a limit set, block_writev() copies its blocks into the cache like
+ * block_write() does instead of writing them to the virtual disk file, so that
+ * writers only pay for memory copies while someone calls block_writeback() in
+ * the background. A writer taking the cache over the limit writes back the
+ * oldest dirty blocks itself until half of the limit is left. There is no
+ * limit by default.
+ *
+ * Return: -1 if there was no virtual disk file opened or if writing back
+ * fails. 0 otherwise.
+ */
+int block_dirty_limit(size_t nblocks);
+
+/**
+ * block_cache_stats - Get block cache counters
+ * @stats: Counters to fill
+ *
+ * Counters are reset every time a disk is opened. @dirty and @size describe
+ * the cache at the time of the call.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_cache_stats(struct block_cache_stats *stats);
+
+/**
+ * block_io_stats - Get transfer counters
+ * @stats: Counters to fill
+ *
+ * Unlike block_cache_stats(), the counters cover every disk opened by the
+ * process, with either interface, since the last call to
+ * block_io_stats_reset(). They are updated without locking, so a concurrent
+ * transfer may only be partly accounted for.
+ *
+ * Return: -1 if the library was built without statistics (with NO_STATS
+ * defined), in which case @stats is zeroed. 0 otherwise.
+ */
+int block_io_stats(struct block_io_stats *stats);
+
+/**
+ * block_io_stats_reset - Reset transfer counters
+ */
+void block_io_stats_reset(void);
+
+/**
+ * block_trace_start - Start tracing block transfers
+ * @path: Name of the trace file to create
+ *
+ * Record every transfer requested from any open disk, with either interface,
+ * to trace file @path until block_trace_stop() is called: reads (including
+ * block_pin()), writes, and block_prefetch() hints. The file starts with a
+ * &struct block_trace_header, followed by a &struct block_trace_rec per
+ * transfer, in host byte order. Records are buffered and written to @path by
+ * the thread whose transfer fills the buffer. Transfers are recorded as
+ * requested, whether the block cache serves them or not, so that a trace can
+ * be replayed against other cache settings. Blocks are numbered in units of
+ * the block size of the first disk with a recorded transfer, and the
+ * transfers of disks with another block size are not recorded.
+ *
+ * Return: -1 if a trace is already running, or if @path cannot be created. 0
+ * otherwise.
+ */
+int block_trace_start(const char *path);
+
+/**
+ * block_trace_stop - Stop tracing block transfers
+ *
+ * Write the buffered records and close the trace file.
+ *
+ * Return: -1 if no trace was running, or if writing the trace file failed. 0
+ * otherwise.
+ */
+int block_trace_stop(void);
+
+/**
+ * block_trace_tag - Label the transfers of the calling thread
+ * @tag: Label, recorded as &struct block_trace_rec.tag
+ *
+ * The label stays set until the next call from the same thread. Threads start
+ * with label 0. The file system labels its transfers with the operation they
+ * belong to, see fs_op_name().
+ */
+void block_trace_tag(int tag);
+
+/**
+ * disk_open - Open a virtual disk file instance
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of options, as for block_disk_open_flags()
+ *
+ * Open virtual disk file @diskname independently of the disk opened with
+ * block_disk_open() and of the other instances. Each instance has its own block
+ * cache, sized as set by the last call to block_cache_resize(), and its own
+ * asynchronous engine. Opening the same file twice is not supported.
+ *
+ * Return: NULL if @diskname is invalid, or if the virtual disk file cannot be
+ * opened or mapped. Otherwise, the disk instance.
+ */
+struct disk *disk_open(const char *diskname, int flags);
+
+/**
+ * disk_open_block_size - Open a virtual disk file instance with a block size
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of options, as for block_disk_open_flags()
+ * @block_size: Size of a block in bytes
+ *
+ * Same as disk_open(), with blocks of @block_size bytes instead of
+ * %BLOCK_SIZE. Every disk_*() function then transfers blocks of that size,
+ * and vectored transfers must be multiples of it.
+ *
+ * Return: NULL if @block_size is not a power of two between %BLOCK_SIZE_MIN
+ * and %BLOCK_SIZE_MAX, or if the size of the virtual disk file is not a
+ * multiple of it, or in the cases of disk_open(). Otherwise, the disk instance.
+ */
+struct disk *disk_open_block_size(const char *diskname, int flags,
+				  size_t block_size);
+
+/**
+ * disk_block_size - Get a disk's block size
+ * @disk: Disk returned by disk_open()
+ *
+ * Return: -1 if @disk is NULL. Otherwise, the size of its blocks in bytes.
+ */
+int disk_block_size(struct disk *disk);
+
+/**
+ * disk_close - Close a virtual disk file instance
+ * @disk: Disk returned by disk_open()
+ *
+ * Flush the block cache of @disk, close its file and free it.
+ *
+ * Return: -1 if @disk is NULL or if its cache cannot be flushed (the disk
+ * stays open then). 0 otherwise.
+ */
+int disk_close(struct disk *disk);
+
+/**
+ * disk_cache_resize - Set the size of a disk's block cache
+ * @disk: Disk returned by disk_open()
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Same as block_cache_resize(), for @disk only.
+ *
+ * Return: -1 if @disk is NULL, if the cache cannot be flushed or allocated, or
+ * if some of its blocks are pinned. 0 otherwise.
+ */
+int disk_cache_resize(struct disk *disk, size_t nblocks);
+
+/*
+ * The following functions behave like their block_*() counterpart, on @disk
+ * instead of the disk opened with block_disk_open(), and with blocks of the
+ * size returned by disk_block_size(). Passing a NULL @disk fails like calling
+ * the counterpart with no disk open.
+ */
+int disk_sync(struct disk *disk);
+void *disk_map(struct disk *disk, size_t block);
+int disk_count(struct disk *disk);
+int disk_write(struct disk *disk, size_t block, const void *buf);
+int disk_read(struct disk *disk, size_t block, void *buf);
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt);
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+	       int iovcnt);
+int disk_aio_setup(struct disk *disk, unsigned int depth, int flags);
+int disk_aio_teardown(struct disk *disk);
+int disk_writev_async(struct disk *disk, size_t block, const struct iovec *iov,
+		      int iovcnt, void *user);
+int disk_readv_async(struct disk *disk, size_t block, const struct iovec *iov,
+		     int iovcnt, void *user);
+int disk_aio_reap(struct disk *disk, struct block_aio_event *events, int max,
+		  int min);
+const void *disk_pin(struct disk *disk, size_t block);
+int disk_unpin(struct disk *disk, size_t block);
+int disk_prefetch(struct disk *disk, size_t block, size_t nblocks);
+int disk_cache_flush(struct disk *disk);
+long disk_writeback(struct disk *disk, unsigned int age_ms, size_t keep);
+int disk_dirty_limit(struct disk *disk, size_t nblocks);
+int disk_cache_stats(struct disk *disk, struct block_cache_stats *stats);
+
 #endif /* _DISK_H */
 
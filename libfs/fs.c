@@ -1,38 +1,102 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
 
-#define FAT_EOC 0xFFFF
+#define FAT_EOC 0xFFFFFFFF //end of chain, as returned by fat_get()
+#define FAT_EOC_V1 0xFFFF //end of chain in a version 1 FAT
+#define RD_HASH_SIZE 256 //buckets of the filename index, a power of two
+#define RD_NONE -1 //no root directory entry
+#define RA_MIN 4 //readahead window, in blocks, once reads look sequential
+#define RA_MAX 64 //largest readahead window, in blocks
+#define FLUSH_EXPIRE_MS 1000 //default age of dirty data the flusher writes back
+#define FLUSH_BACKGROUND_RATIO 10 //default % of the cache dirty before the flusher writes anyway
+#define FLUSH_DIRTY_RATIO 50 //default % of the cache dirty before writers write back
 #define ceilingdiv(x,y) \
 	1 + ((x - 1) / y)
+//implementations of the public operations, wrapped by the fs_*_ctx() functions
+static int do_aio_teardown(fs_t *fs);
+static int do_aio_poll(fs_t *fs, struct fs_aio_event *events, int max, int min);
+static int do_release_view(fs_t *fs, struct fs_view *view);
+static int64_t do_stat64(fs_t *fs, int fd);
 //phase 1-2 function prototypes
+static void fs_free(fs_t *fs);
+static void file_lock(fs_t *fs, int fsrd, int write);
+static void file_unlock(fs_t *fs, int fsrd);
+static int flusher_start(fs_t *fs);
+static void flusher_stop(fs_t *fs);
+static void flusher_kick(fs_t *fs);
+static int flusher_tune(fs_t *fs, unsigned int expire_ms,
+			unsigned int background_ratio, unsigned int dirty_ratio);
 int bytes_to_block(int y);
-static int delete_file(int fir_block);
-static char * resize_buffer(char * buffer, int old_size, int * new_size);
-static int update_RD();
-static int read_in_RD();
-static int read_in_FAT();
-static int update_FAT();
-static int delete_root(const char * fname);
-static int file_exist(const char * fname);
-static int delete_file(int fir_block);
-static struct Root_Dir * create_root(const char *file_n);
-static int next_block();
-static int free_FAT_blocks();
-static int free_RD_blocks();
+static int filename_valid(const char *filename);
+static int delete_file(fs_t *fs, uint32_t fir_block);
+static int update_RD(fs_t *fs);
+static int read_in_RD(fs_t *fs);
+static int read_in_FAT(fs_t *fs);
+static int update_FAT(fs_t *fs);
+static uint32_t fat_get(fs_t *fs, uint32_t index);
+static void fat_set(fs_t *fs, uint32_t index, uint32_t value);
+static int read_in_SB(fs_t *fs, const char *diskname);
+static int delete_root(fs_t *fs, const char * fname);
+static int file_exist(fs_t *fs, const char * fname);
+static int delete_file(fs_t *fs, uint32_t fir_block);
+static struct Root_Dir * create_root(fs_t *fs, const char *file_n);
+static int free_FAT_blocks(fs_t *fs);
+static int free_RD_blocks(fs_t *fs);
 //phase 3 function prototypes
-static int fs_fd_init(int fd, const char *filename);
-static int return_rd(char * fd_name);
-static int next_block();
-static int fd_exists(int fd);
-static int file_exists(const char * fd_name);
-static uint32_t file_extend(int fd, uint16_t blockcount);
-
-struct __attribute__((__packed__)) sBlock {
+static int fs_fd_init(fs_t *fs, int fd, int fsrd);
+static int return_rd(fs_t *fs, const char * fd_name);
+static int fd_exists(fs_t *fs, int fd);
+static int file_exists(fs_t *fs, const char * fd_name);
+static uint32_t file_extend(fs_t *fs, int fd, size_t blockcount);
+//phase 4 function prototypes
+static struct Block_Map * bmap_get(fs_t *fs, int fsrd);
+static void bmap_put(fs_t *fs, int fsrd);
+static int bmap_append(struct Block_Map * map, uint32_t block);
+static size_t bmap_run(struct Block_Map * map, size_t idx, size_t max);
+static int fmap_build(fs_t *fs);
+static void fmap_take(fs_t *fs, uint32_t block);
+static void fmap_release(fs_t *fs, uint32_t block);
+static int fmap_is_free(fs_t *fs, size_t block);
+static size_t fmap_find_run(fs_t *fs, size_t want, uint32_t *start);
+static size_t alloc_run(fs_t *fs, size_t goal, size_t want, uint32_t *start);
+static int chain_add_run(fs_t *fs, int fsrd, uint32_t start, size_t count);
+static int bmap_reserve(struct Block_Map * map, size_t count);
+//file transfer function prototypes
+struct Aio_Req;
+static int file_write_at(fs_t *fs, int fd, const struct iovec *iov,
+			 int iovcnt, size_t count, size_t file_offset,
+			 struct Aio_Req * req);
+static int file_read_at(fs_t *fs, int fd, const struct iovec *iov, int iovcnt,
+			size_t count, size_t file_offset, struct Aio_Req * req);
+static int file_xfer(fs_t *fs, int write, struct Block_Map * map,
+		     const struct iovec *iov, int iovcnt, size_t count,
+		     size_t file_offset, size_t filesize, struct Aio_Req * req);
+static int fd_writev(fs_t *fs, int fd, const struct iovec *iov, int iovcnt,
+		     size_t count);
+static int fd_readv(fs_t *fs, int fd, const struct iovec *iov, int iovcnt,
+		    size_t count);
+static int iov_total(const struct iovec *iov, int iovcnt, size_t *count);
+static int file_grow(fs_t *fs, int fd, size_t end);
+static void file_readahead(fs_t *fs, int fd, size_t offset, size_t count);
+static struct Aio_Req * aio_req_new(fs_t *fs, int fd, void *user);
+static void aio_req_put(fs_t *fs, struct Aio_Req * req);
+static unsigned int rd_hash(const char * fname);
+static void rd_index_add(fs_t *fs, int fsrd);
+static void rd_index_remove(fs_t *fs, int fsrd);
+
+//on-disk superblock of the original ECS150FS format, version 1
+struct __attribute__((__packed__)) sBlock_V1 {
 	
 	char Sig[8];//Signature
 	uint16_t tNumBlocks;//Total Number of Blocks
@@ -43,236 +107,564 @@ struct __attribute__((__packed__)) sBlock {
 	char padding[4079];//Padding
 };
 
+//on-disk superblock of version 2 and later. It starts with the same
+//signature and a zero block count, so that version 1 readers refuse it
+struct __attribute__((__packed__)) sBlock_V2 {
+
+	char Sig[8];//Signature
+	uint16_t v1_NumBlocks;//always 0
+	uint16_t version;//format version
+	uint32_t block_size;//bytes per block
+	uint32_t tNumBlocks;//Total Number of Blocks
+	uint32_t rdb_Index;//Root directory index
+	uint32_t d_block_start;//Datablock start index
+	uint32_t nDataBlocks;//Total number of data blocks
+	uint32_t nFAT_Blocks;//Total number of FAT blocks
+	char padding[4060];//Padding
+};
+
+//superblock of the mounted file system, whatever its version
+struct sBlock {
+
+	int version;//format version, FS_FORMAT_V1 or FS_FORMAT_V2
+	uint32_t block_size;//bytes per block
+	uint32_t nRD_Blocks;//blocks of the root directory, several if they're small
+	uint32_t tNumBlocks;//Total Number of Blocks
+	uint32_t rdb_Index;//Root directory index
+	uint32_t d_block_start;//Datablock start index
+	uint32_t nDataBlocks;//Total number of data blocks
+	uint32_t nFAT_Blocks;//Total number of FAT blocks
+};
+
 typedef struct __attribute__((__packed__)) FAT {
 	
-	uint16_t *f_table;//pointer to FAT
+	void *f_table;//pointer to FAT, entries as wide as on disk
+	size_t entry_size;//bytes per FAT entry, 2 for version 1 and 4 after
 }t2;
 
-typedef struct __attribute__((__packed__)) Root_Dir {
-	
+//on-disk root directory entry of version 1
+struct __attribute__((__packed__)) Root_Dir_V1 {
+
 	char fname[FS_FILENAME_LEN];//Filename
 	uint32_t fSize;//file size
 	uint16_t  f_index;//index of first FAT block
 	char padding[10];
+};
+
+//root directory entry, in memory and on disk from version 2
+typedef struct __attribute__((__packed__)) Root_Dir {
+	
+	char fname[FS_FILENAME_LEN];//Filename
+	uint64_t fSize;//file size
+	uint32_t f_index;//index of first FAT block
+	char padding[4];
 }t3;
 
 typedef struct fs_filedes {
 
-	int fd_offset; //file descriptor offset
-	char fd_filename[FS_FILENAME_LEN]; //filename
+	size_t fd_offset; //file descriptor offset
+	int fd_rd; //RD index of the open file, RD_NONE if closed
+	int fd_sync; //write directory updates through instead of deferring them
+	int fd_aio; //asynchronous requests in flight
+	size_t fd_ra_next; //chain index of the block a sequential read starts in
+	size_t fd_ra_end; //chain index up to which blocks were read ahead
+	size_t fd_ra_size; //next readahead window in blocks, 0 for random reads
+	pthread_mutex_t fd_lock; //fd_offset and the readahead state, for readers sharing the descriptor
 }t4;
 
-int fd_total=0; //total number file descriptors
-int FS_Mount=0; //indicate if file system mounted
+typedef struct Block_Map {
+
+	uint32_t *blocks; //data blocks of the file, in chain order
+	size_t count; //number of blocks in the chain
+	size_t cap; //allocated entries of blocks
+	int refs; //number of file descriptors using the map
+	pthread_rwlock_t lock; //shared to read the file, exclusive to change it
+}t5;
+
+typedef struct Aio_Req {
+
+	void *user; //caller's cookie
+	int fd; //file descriptor the request was submitted on
+	int result; //bytes transferred, -1 on failure
+	size_t end; //file size once a write completes, 0 for reads
+	int pending; //block transfers in flight, plus the submitter's reference
+	struct Aio_Req *next; //next completed request
+}t7;
+
+typedef struct Aio_State {
+
+	int active; //fs_aio_setup() was called
+	int inflight; //requests not returned by fs_aio_poll() yet
+	struct Aio_Req *done_head, *done_tail; //completed requests
+	int reaping; //a poller is collecting block completions
+	pthread_cond_t reap_cond; //signaled when that poller is done
+}t8;
+
+typedef struct Free_Map {
+
+	uint64_t *words; //one bit per data block, set when the block is free
+	uint64_t *summary; //one bit per word of words, set when it has a free bit
+	size_t nwords; //number of entries in words
+	int nfree; //number of free data blocks
+}t6;
+
+typedef struct fs {
+
+	struct disk *disk; //virtual disk the file system is mounted from
+
+	//locks, always taken in this order: ns_lock, a file's lock (in its
+	//block map), alloc_lock, rd_lock, aio_lock. A descriptor's fd_lock is
+	//taken last, and held without calling into anything but the disk
+	pthread_mutex_t ns_lock; //file names and their index, fd table, block map references
+	pthread_mutex_t alloc_lock; //FAT, fat_dirty and free map
+	pthread_mutex_t rd_lock; //RD entries and rd_dirty
+	pthread_mutex_t aio_lock; //aio, fd_aio, and block engine submissions (reaping is left to aio.reaping)
+
+	//background flusher, running if mounted with FS_MOUNT_FLUSH
+	pthread_t flusher;
+	pthread_mutex_t flush_lock; //flush_stop and the thresholds, taken last
+	pthread_cond_t flush_cond; //wakes up the flusher early
+	int flush_running;
+	int flush_stop;
+	unsigned int flush_expire; //ms before dirty data is written back
+	size_t flush_background; //dirty blocks the flusher leaves in the cache
+
+	int fd_total; //total number file descriptors
+	int rd_dirty; //indicate if RD changed since it was last written
+	size_t view_blocks; //cache blocks pinned by views, at most half the cache
+	struct Aio_State aio; //asynchronous request engine
+
+	struct fs_filedes *filedes; //pointer to fd table
+	struct sBlock * SB; //pointer to superblock
+	struct Root_Dir * RD; //pointer to root directory
+	struct FAT * fat; //pointer to FAT table
+	uint8_t * fat_dirty; //one flag per FAT block, set when it must be written
+	struct Block_Map * bmap; //block maps of open files, by RD index
+	struct Free_Map fmap; //free data block bitmap
+	int rd_bucket[RD_HASH_SIZE]; //filename hash buckets, first RD index of chain
+	int rd_next[FS_FILE_MAX_COUNT]; //next RD index in the same bucket
+}t9;
+
+fs_t * default_fs = NULL; //file system mounted with fs_mount(), NULL if none
+
+#ifndef NO_STATS
+typedef struct Op_Stats {
+
+	uint64_t calls; //number of calls
+	uint64_t errors; //calls that failed
+	uint64_t bytes; //bytes transferred
+	uint64_t max_ns; //highest latency
+	uint64_t hist[FS_STATS_BUCKETS]; //calls by log2 of their latency in ns
+}t10;
+
+//statistics of every file system of the process, updated with relaxed atomics
+static struct {
+	struct Op_Stats ops[FS_OP_COUNT];
+	uint64_t bounces;
+	uint64_t rmw;
+	uint64_t fat_flushed;
+} stats;
+
+#define STATS_ADD(field, n) \
+	__atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_START(start) \
+	uint64_t start = stats_clock()
+#define STATS_END(op, start, failed, nbytes) \
+	stats_record(op, start, failed, nbytes)
+
+static uint64_t stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-struct fs_filedes *filedes; //pointer to fd table
-struct sBlock * SB; //pointer to superblock
-struct Root_Dir * RD; //pointer to root directory
-struct FAT * fat; //pointer to FAT table
+//account for a call to operation op that started at start
+static void stats_record(int op, uint64_t start, int failed, uint64_t nbytes)
+{
+	struct Op_Stats *os = &stats.ops[op];
+	uint64_t ns = stats_clock() - start;
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
 
-int fs_mount(const char *diskname)
+	if (bucket >= FS_STATS_BUCKETS) {
+		bucket = FS_STATS_BUCKETS - 1;
+	}
+
+	__atomic_fetch_add(&os->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&os->hist[bucket], 1, __ATOMIC_RELAXED);
+	if (failed) {
+		__atomic_fetch_add(&os->errors, 1, __ATOMIC_RELAXED);
+	}
+	if (nbytes) {
+		__atomic_fetch_add(&os->bytes, nbytes, __ATOMIC_RELAXED);
+	}
+
+	uint64_t max = __atomic_load_n(&os->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&os->max_ns, &max, ns, 1,
+							 __ATOMIC_RELAXED,
+							 __ATOMIC_RELAXED));
+}
+#else
+#define STATS_ADD(field, n)
+#define STATS_START(start)
+#define STATS_END(op, start, failed, nbytes)
+#endif
+
+//every public operation runs between OP_START() and OP_END(), which account
+//for it in fs_stats() and label its block transfers in traces
+#define OP_START(op, start) \
+	block_trace_tag((op) + 1); \
+	STATS_START(start)
+#define OP_END(op, start, failed, nbytes) \
+	STATS_END(op, start, failed, nbytes); \
+	block_trace_tag(0)
+
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size, int version)
 {
-	//compare SB signature to this in order to validate it
+	//signature of every version
 	char signature[8] = {'E','C','S','1','5','0','F','S'};
+	union {
+		struct sBlock_V1 v1;
+		struct sBlock_V2 v2;
+	} sb;
+	size_t entry_size;
 
-	//allocate the heap memory for the superblock, root directory,
-	//and the fat table
-	SB = (struct sBlock*) calloc(1,sizeof(struct sBlock));
-	RD = (struct Root_Dir*) calloc(FS_FILE_MAX_COUNT, sizeof(struct Root_Dir));
-	fat= (struct FAT*) calloc(1,sizeof(struct FAT));
-
-	//filename cannot be a NULL terminator
-	if (diskname[0]=='\0') {
+	if (diskname == NULL || diskname[0]=='\0' || data_blocks == 0 || data_blocks > INT_MAX) {
 		return -1;
 	}
-	
-	//open disk
-	if (block_disk_open(diskname)!=0) {
-		free(SB);
-		free(RD);
+	if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX || (block_size & (block_size - 1))) {
 		return -1;
 	}
-	
-	//read in superblock
-	if (block_read(0, (void*)SB)!=0) {
-		free(SB);
-		free(RD);
+	if (version == FS_FORMAT_V1 && block_size == BLOCK_SIZE) {
+		entry_size = sizeof(uint16_t);
+	} else if (version == FS_FORMAT_V2) {
+		entry_size = sizeof(uint32_t);
+	} else {
 		return -1;
 	}
 
-	SB = (struct sBlock*)SB;
+	//the superblock, the FAT, the root directory, then the data blocks.
+	//The whole disk must be numbered by the superblock and disk_count()
+	size_t fat_blocks = ceilingdiv(data_blocks * entry_size, block_size);
+	size_t rd_blocks = ceilingdiv(FS_FILE_MAX_COUNT * sizeof(struct Root_Dir), block_size);
+	size_t total = 1 + fat_blocks + rd_blocks + data_blocks;
+	if (total > (version == FS_FORMAT_V1 ? UINT16_MAX : INT_MAX)) {
+		return -1;
+	}
 
-	//validate that SB has correct signature 
-	//use strncmp becasue it's not NULL terminated
-	if (strncmp(signature, SB->Sig,8)!=0) {
-		free(SB);
-		free(RD);
+	memset(&sb, 0, sizeof(sb));
+	memcpy(sb.v1.Sig, signature, sizeof(signature));
+	if (version == FS_FORMAT_V1) {
+		sb.v1.tNumBlocks = total;
+		sb.v1.rdb_Index = 1 + fat_blocks;
+		sb.v1.d_block_start = 1 + fat_blocks + rd_blocks;
+		sb.v1.nDataBlocks = data_blocks;
+		sb.v1.nFAT_Blocks = fat_blocks;
+	} else {
+		sb.v2.version = version;
+		sb.v2.block_size = block_size;
+		sb.v2.tNumBlocks = total;
+		sb.v2.rdb_Index = 1 + fat_blocks;
+		sb.v2.d_block_start = 1 + fat_blocks + rd_blocks;
+		sb.v2.nDataBlocks = data_blocks;
+		sb.v2.nFAT_Blocks = fat_blocks;
+	}
+
+	//the entry of data block 0 is reserved, every other one is free
+	char *fat = calloc(1, block_size);
+	if (fat == NULL) {
 		return -1;
 	}
+	memset(fat, 0xFF, entry_size);
 
-	//make sure total number of blocks in SB
-	//matches the number of blocks returned by block_disk_count()
-	if (block_disk_count()!=SB->tNumBlocks) {
-		free(SB);
-		free(RD);
+	//everything else starts zeroed, leave it to ftruncate(). A small
+	//superblock block only holds the start of the structure
+	size_t sb_len = block_size < sizeof(sb) ? block_size : sizeof(sb);
+	int ret = 0;
+	int fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(fat);
 		return -1;
 	}
+	if (ftruncate(fd, (off_t)total * block_size)
+	    || pwrite(fd, &sb, sb_len, 0) != (ssize_t)sb_len
+	    || pwrite(fd, fat, block_size, block_size) != (ssize_t)block_size) {
+		ret = -1;
+	}
+	if (close(fd)) {
+		ret = -1;
+	}
+	free(fat);
+
+	return ret;
+}
+
+static fs_t * do_mount(const char *diskname, int flags)
+{
+	//filename cannot be a NULL terminator
+	if (diskname == NULL || diskname[0]=='\0') {
+		return NULL;
+	}
+
+	//allocate the heap memory for the context, the superblock and the fat
+	//table. The root directory's depends on the block size
+	fs_t * fs = calloc(1, sizeof(fs_t));
+	if (fs == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&fs->ns_lock, NULL);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_mutex_init(&fs->rd_lock, NULL);
+	pthread_mutex_init(&fs->aio_lock, NULL);
+	pthread_cond_init(&fs->aio.reap_cond, NULL);
+	pthread_mutex_init(&fs->flush_lock, NULL);
+	fs->SB = (struct sBlock*) calloc(1,sizeof(struct sBlock));
+	fs->fat= (struct FAT*) calloc(1,sizeof(struct FAT));
+	if (fs->SB == NULL || fs->fat == NULL) {
+		fs_free(fs);
+		return NULL;
+	}
 	
-	//initialize empty entries of root directory
-	for (int i =0; i<FS_FILE_MAX_COUNT; i++) {
-		RD[i].fname[0]='\0';
-		
+	//read in and validate the superblock, of either version
+	if (read_in_SB(fs, diskname)!=0) {
+		fs_free(fs);
+		return NULL;
+	}
+
+	//open disk with the block size it was formatted with, mapped in
+	//memory if requested
+	fs->disk = disk_open_block_size(diskname, (flags & FS_MOUNT_MMAP) ? BLOCK_DISK_MMAP : 0,
+					fs->SB->block_size);
+	if (fs->disk == NULL) {
+		fs_free(fs);
+		return NULL;
+	}
+
+	//make sure total number of blocks in SB
+	//matches the number of blocks returned by disk_count()
+	if (disk_count(fs->disk)<0 || (uint32_t)disk_count(fs->disk)!=fs->SB->tNumBlocks) {
+		fs_free(fs);
+		return NULL;
+	}
+
+	//the root directory covers whole blocks, to be transferred straight
+	//from memory
+	fs->RD = calloc(fs->SB->nRD_Blocks, fs->SB->block_size);
+	if (fs->RD == NULL) {
+		fs_free(fs);
+		return NULL;
 	}
 	
 	//create file decriptor table
-	filedes = calloc(FS_OPEN_MAX_COUNT, sizeof(struct fs_filedes));
-	//initialize name of each file decriptor name to '\0'
+	fs->filedes = calloc(FS_OPEN_MAX_COUNT, sizeof(struct fs_filedes));
+	//block maps are built when files are opened
+	fs->bmap = calloc(FS_FILE_MAX_COUNT, sizeof(struct Block_Map));
+	if (fs->filedes == NULL || fs->bmap == NULL) {
+		fs_free(fs);
+		return NULL;
+	}
+
+	//mark each file decriptor as closed
 	for (int i =0; i<FS_OPEN_MAX_COUNT; i++) {
-		filedes[i].fd_filename[0] = '\0';
-		
+		fs->filedes[i].fd_rd = RD_NONE;
+		pthread_mutex_init(&fs->filedes[i].fd_lock, NULL);
+	}
+	for (int i =0; i<FS_FILE_MAX_COUNT; i++) {
+		pthread_rwlock_init(&fs->bmap[i].lock, NULL);
+	}
+
+	//the FAT blocks must be able to hold an entry for every data block
+	fs->fat->entry_size = fs->SB->version == FS_FORMAT_V1 ? sizeof(uint16_t) : sizeof(uint32_t);
+	if ((size_t)fs->SB->nFAT_Blocks * fs->SB->block_size < fs->SB->nDataBlocks * fs->fat->entry_size) {
+		fs_free(fs);
+		return NULL;
 	}
 
-	//initialize FAT table and all indices to 0
-	fat->f_table =  calloc(SB->nDataBlocks, sizeof(struct FAT));
+	//initialize FAT table and all indices to 0. It covers whole FAT
+	//blocks so that each of them can be written straight from memory
+	fs->fat->f_table = calloc(fs->SB->nFAT_Blocks, fs->SB->block_size);
+	fs->fat_dirty = calloc(fs->SB->nFAT_Blocks, sizeof(uint8_t));
+	if (fs->fat->f_table == NULL || fs->fat_dirty == NULL) {
+		fs_free(fs);
+		return NULL;
+	}
 	
 	//read the FAT table in from the disk
-	if (read_in_FAT()!=0) {
-		return -1;
+	if (read_in_FAT(fs)!=0) {
+		fs_free(fs);
+		return NULL;
 	}
 
 	//make sure first FAT block is 
-	if (fat->f_table[0]!=FAT_EOC) {
-		free(SB);
-		free(RD);
-		free(fat->f_table);
-		free(fat);
-		free(filedes);
-		return -1;
+	if (fat_get(fs, 0)!=FAT_EOC) {
+		fs_free(fs);
+		return NULL;
 	}
 		
 	//read in the root directory 
-	if (read_in_RD()!=0) {
-		return -1;
+	if (read_in_RD(fs)!=0) {
+		fs_free(fs);
+		return NULL;
+	}
+
+	fs->rd_dirty = 0;
+
+	//index the filenames of the root directory
+	for (int i=0; i<RD_HASH_SIZE; i++) {
+		fs->rd_bucket[i] = RD_NONE;
+	}
+	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
+		if (fs->RD[i].fname[0]!='\0') {
+			rd_index_add(fs, i);
+		}
+	}
+
+	//index the free data blocks
+	if (fmap_build(fs)!=0) {
+		fs_free(fs);
+		return NULL;
+	}
+
+	//start writing back in the background if asked to
+	if ((flags & FS_MOUNT_FLUSH) && flusher_start(fs)) {
+		fs_free(fs);
+		return NULL;
 	}
-		
-	//indicate that file system has been mounted
-	FS_Mount=1;
-	
-	return 0;
-	
 	
+	return fs;
 }
 
 
-int fs_umount(void)
+static int do_umount(fs_t *fs)
 {
 	//check if a virtual disk is open
 	//Check if there are open file descriptors
-	if (FS_Mount==0||fd_total>0) {
+	if (fs==NULL||fs->fd_total>0) {
 		return -1;
 	}
 
-	if (update_RD()) {
+	//drop the completions nobody polled
+	if (fs->aio.active && do_aio_teardown(fs)) {
+		return -1;
+	}
+
+	//nothing is left for the flusher, everything is written below
+	flusher_stop(fs);
+
+	if (update_RD(fs)) {
 		return -1;
 	}
 
-	if (update_FAT()) {
+	if (update_FAT(fs)) {
 		return -1;
 	}
 
-	//must do close disk before calling block_disk_close(),
+	//must do close disk before calling fs_free(),
 	//just in case it returns -1
-	if (block_disk_close()) {
+	if (disk_close(fs->disk)) {
 		return -1;
 	}
+	fs->disk = NULL;
 
 	//after updating the disk and closing it, free all
 	//metadata data structures
-	free(SB);
-	free(RD);
-	free(fat->f_table);
-	free(fat);
-	free(filedes);
+	fs_free(fs);
 	return 0;
 }
 
-int fs_info(void)
+static int do_sync(fs_t *fs)
+{
+	//make sure file system is mounted
+	if (fs==NULL) {
+		return -1;
+	}
+
+	//only the FAT blocks which changed are written
+	if (update_FAT(fs)) {
+		return -1;
+	}
+
+	if (update_RD(fs)) {
+		return -1;
+	}
+
+	//push the cached data blocks to the disk image and wait until
+	//they are stored
+	if (disk_sync(fs->disk)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int do_info(fs_t *fs)
 {
 	//Ensure file system has been mounted
-	if (FS_Mount==0) {
+	if (fs==NULL) {
 		return -1;
 	}
 
 	//Required output for 'info'
 	fprintf(stdout,"FS Info:\n");
-	fprintf(stdout,"total_blk_count=%d\n",SB->tNumBlocks);
-	fprintf(stdout,"fat_blk_count=%d\n",SB->nFAT_Blocks);
-	fprintf(stdout,"rdir_blk=%d\n",SB->rdb_Index);
-	fprintf(stdout,"data_blk=%d\n",SB->d_block_start);
-	fprintf(stdout,"data_blk_count=%d\n",SB->nDataBlocks);
-	fprintf(stdout,"fat_free_ratio=%d/%d\n",free_FAT_blocks(),SB->nDataBlocks);
-	fprintf(stdout,"rdir_free_ratio=%d/%d\n",free_RD_blocks(),FS_FILE_MAX_COUNT);
+	fprintf(stdout,"total_blk_count=%u\n",fs->SB->tNumBlocks);
+	fprintf(stdout,"fat_blk_count=%u\n",fs->SB->nFAT_Blocks);
+	fprintf(stdout,"rdir_blk=%u\n",fs->SB->rdb_Index);
+	fprintf(stdout,"data_blk=%u\n",fs->SB->d_block_start);
+	fprintf(stdout,"data_blk_count=%u\n",fs->SB->nDataBlocks);
+	pthread_mutex_lock(&fs->alloc_lock);
+	fprintf(stdout,"fat_free_ratio=%d/%u\n",free_FAT_blocks(fs),fs->SB->nDataBlocks);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_lock(&fs->ns_lock);
+	fprintf(stdout,"rdir_free_ratio=%d/%d\n",free_RD_blocks(fs),FS_FILE_MAX_COUNT);
+	pthread_mutex_unlock(&fs->ns_lock);
 
 	return 0;
 }
 
-int fs_create(const char *filename)
+static int do_create(fs_t *fs, const char *filename)
 {
 	//make sure file system has been mounted
-	if (FS_Mount==0) {
+	if (fs==NULL) {
 		return -1;
 	}
 
-	//ensure that the root directory isn't full
-	if (free_RD_blocks()<1) {
-		return -1;
-	}
-	
 	//check if filename is valid
-	if (filename == NULL) {
+	if (filename_valid(filename)) {
 		return -1;
 	}
 
-	if (filename[0] == '\0') {
-		return -1;
-	}
-
-	//check if filename is NULL terminated and within the
-	//length limit
-	int i = 0;
-	while (filename[i] != '\0') {
-		if ((i+1==FS_FILENAME_LEN)&&(filename[i] != '\0')) {
-			return -1;
-		}
-		i++;
-	}
+	pthread_mutex_lock(&fs->ns_lock);
 
+	//ensure that the root directory isn't full, and
 	//cannot have two files with same name
-	if (!file_exists(filename)) {
+	if (free_RD_blocks(fs)<1 || !file_exists(fs, filename)) {
+		pthread_mutex_unlock(&fs->ns_lock);
 		return -1;
 	}
 
-	struct Root_Dir * new_file = create_root(filename);
+	pthread_mutex_lock(&fs->rd_lock);
+	struct Root_Dir * new_file = create_root(fs, filename);
 
 	//make sure an entry was returned
-	if (new_file==NULL) {
-		return -1;
+	if (new_file!=NULL) {
+		//set the new files size to 0 and its first data 
+		//block index to FAT_EOC
+		new_file->fSize=0;
+		new_file->f_index=FAT_EOC;
+		fs->rd_dirty = 1;
 	}
+	pthread_mutex_unlock(&fs->rd_lock);
+	pthread_mutex_unlock(&fs->ns_lock);
 
-	strcpy(new_file->fname,filename);
-
-	//set the new files size to 0 and its first data 
-	//block index to FAT_EOC
-	new_file->fSize=0;
-	new_file->f_index=FAT_EOC;
-	return 0;
+	return new_file==NULL ? -1 : 0;
 	
 }
 
-int fs_delete(const char *filename)
+static int do_delete(fs_t *fs, const char *filename)
 {
 	//make sure file system is mounted
-	if (FS_Mount==0) {
+	if (fs==NULL) {
 		return -1;
 	}
 
@@ -280,46 +672,150 @@ int fs_delete(const char *filename)
 	
 	char null[1] = {'\0'};
 
-	if (file_exist(filename)!=0||(strncmp(filename,null,1)==0)) {
+	if (filename == NULL || (strncmp(filename,null,1)==0)) {
 		return -1;
 	}
 
-	//check to see if filename is open in any file descriptors
-	for (int z=0; z<FS_OPEN_MAX_COUNT;z++) {
-		if (strcmp(filedes[z].fd_filename,filename)==0) {
-			return -1;
+	pthread_mutex_lock(&fs->ns_lock);
+
+	//the file's RD entry
+	int i = return_rd(fs, filename);
+
+	//check to see if filename is open in any file descriptors,
+	//every open file descriptor holds a reference to the block map
+	if (i == RD_NONE || fs->bmap[i].refs > 0) {
+		pthread_mutex_unlock(&fs->ns_lock);
+		return -1;
+	}
+
+	//delete the file's FAT entries as well as its RD entry
+	//if file is empty it shouldn't be sent to delete_file()
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->RD[i].f_index!=FAT_EOC) {
+		delete_file(fs, fs->RD[i].f_index);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	pthread_mutex_lock(&fs->rd_lock);
+	delete_root(fs, filename);
+	fs->RD[i].fSize=0;
+	fs->RD[i].f_index=FAT_EOC;
+	fs->rd_dirty = 1;
+	pthread_mutex_unlock(&fs->rd_lock);
+	pthread_mutex_unlock(&fs->ns_lock);
+
+	return 0;
+}
+
+static int do_create_many(fs_t *fs, const char **filenames, int count,
+			  int *results)
+{
+	//make sure file system has been mounted
+	if (fs==NULL || filenames==NULL || results==NULL || count<0) {
+		return -1;
+	}
+
+	int created = 0;
+	int slot = 0; //RD entries before slot are all used
+
+	pthread_mutex_lock(&fs->ns_lock);
+	pthread_mutex_lock(&fs->rd_lock);
+	for (int n = 0; n < count; n++) {
+		results[n] = -1;
+
+		//names already in the index include those created by
+		//earlier items of the batch
+		if (filename_valid(filenames[n]) ||
+		    return_rd(fs, filenames[n]) != RD_NONE) {
+			continue;
+		}
+
+		//a single scan of RD hands out the free entries in order
+		while (slot < FS_FILE_MAX_COUNT && fs->RD[slot].fname[0] != '\0') {
+			slot++;
 		}
+		if (slot == FS_FILE_MAX_COUNT) {
+			continue;
+		}
+
+		strcpy(fs->RD[slot].fname, filenames[n]);
+		fs->RD[slot].fSize = 0;
+		fs->RD[slot].f_index = FAT_EOC;
+		rd_index_add(fs, slot);
+		results[n] = 0;
+		created++;
 	}
+	if (created) {
+		fs->rd_dirty = 1;
+	}
+	pthread_mutex_unlock(&fs->rd_lock);
+	pthread_mutex_unlock(&fs->ns_lock);
 
-	//search for file in RD, the delete it's FAT entry as well
-	//as it's RD entry
-	int i=0;
-	while (i<FS_FILE_MAX_COUNT) {
-		if ((strcmp(RD[i].fname,filename)==0)&&(RD[i].f_index!=FAT_EOC)) {
-			delete_file(RD[i].f_index);
-			delete_root(filename);
-			RD[i].fSize=0;
-			RD[i].f_index=FAT_EOC;
-			break;
+	//one write of the root directory stores the whole batch
+	if (update_RD(fs) || disk_sync(fs->disk)) {
+		return -1;
+	}
+
+	return created;
+}
+
+static int do_delete_many(fs_t *fs, const char **filenames, int count,
+			  int *results)
+{
+	//make sure file system has been mounted
+	if (fs==NULL || filenames==NULL || results==NULL || count<0) {
+		return -1;
+	}
+
+	int deleted = 0;
+
+	pthread_mutex_lock(&fs->ns_lock);
+	pthread_mutex_lock(&fs->alloc_lock);
+	pthread_mutex_lock(&fs->rd_lock);
+	for (int n = 0; n < count; n++) {
+		results[n] = -1;
+
+		if (filenames[n] == NULL || filenames[n][0] == '\0') {
+			continue;
 		}
 
-		//if file is empty it shouldn't be sent to delete_file()
-		if ((strcmp(RD[i].fname,filename)==0)&&(RD[i].f_index==FAT_EOC)) { 
-			delete_root(filename);
-			RD[i].fSize=0;
-			RD[i].f_index=FAT_EOC;
-			break;
+		//open files cannot be deleted, as with fs_delete()
+		int i = return_rd(fs, filenames[n]);
+		if (i == RD_NONE || fs->bmap[i].refs > 0) {
+			continue;
 		}
-		i++;
+
+		//the freed chains only mark their FAT blocks dirty
+		if (fs->RD[i].f_index != FAT_EOC) {
+			delete_file(fs, fs->RD[i].f_index);
+		}
+		rd_index_remove(fs, i);
+		fs->RD[i].fname[0] = '\0';
+		fs->RD[i].fSize = 0;
+		fs->RD[i].f_index = FAT_EOC;
+		results[n] = 0;
+		deleted++;
+	}
+	if (deleted) {
+		fs->rd_dirty = 1;
+	}
+	pthread_mutex_unlock(&fs->rd_lock);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_unlock(&fs->ns_lock);
+
+	//one write of the root directory and of each run of FAT blocks
+	//stores the whole batch
+	if (update_RD(fs) || update_FAT(fs) || disk_sync(fs->disk)) {
+		return -1;
 	}
 
-	return 0;
+	return deleted;
 }
 
-int fs_ls(void)
+static int do_ls(fs_t *fs)
 {
 	//make sure file system is mounted
-	if (FS_Mount==0) {
+	if (fs==NULL) {
 		return -1;
 	}
 	
@@ -328,20 +824,27 @@ int fs_ls(void)
 
 	//iterate through RD and print the information
 	//for entries that aren't empty
+	pthread_mutex_lock(&fs->rd_lock);
 	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
-		if (RD[i].fname[0]!='\0') {
-			fprintf(stdout,"file: %s, size: %d, data_blk: %d\n",RD[i].fname,RD[i].fSize,RD[i].f_index);
+		if (fs->RD[i].fname[0]!='\0') {
+			//print the first block as stored on disk
+			uint32_t data_blk = fs->RD[i].f_index;
+			if (data_blk==FAT_EOC && fs->SB->version==FS_FORMAT_V1) {
+				data_blk = FAT_EOC_V1;
+			}
+			fprintf(stdout,"file: %s, size: %llu, data_blk: %u\n",fs->RD[i].fname,(unsigned long long)fs->RD[i].fSize,data_blk);
 		}
 	}
+	pthread_mutex_unlock(&fs->rd_lock);
 
 	return 0;
 	
 }
 
-int fs_open(const char *filename)
+static int do_open(fs_t *fs, const char *filename)
 {
 	//make sure file system is mounted
-	if (FS_Mount==0) {
+	if (fs==NULL) {
 		return -1;
 	}
 
@@ -357,32 +860,45 @@ int fs_open(const char *filename)
 		i++;
 	}
 
+	pthread_mutex_lock(&fs->ns_lock);
+
 	//make sure fie exists before trying to open it
-	if (file_exists(filename)==-1) {
+	int fsrd = return_rd(fs, filename);
+	if (fsrd == RD_NONE) {
+		pthread_mutex_unlock(&fs->ns_lock);
 		return -1;
 	}
 
 	int j = 0;
 	//check if there is an available file des spot
 	//j will equal the first open spot starting from index 0
-	while (filedes[j].fd_filename[0] != '\0') {
-		if (j > FS_OPEN_MAX_COUNT)
-			return -1;
+	while (fs->filedes[j].fd_rd != RD_NONE) {
 		j++;
+		if (j == FS_OPEN_MAX_COUNT) {
+			pthread_mutex_unlock(&fs->ns_lock);
+			return -1;
+		}
+	}
+
+	//map the file's chain so that offsets resolve without walking the FAT
+	if (bmap_get(fs, fsrd) == NULL) {
+		pthread_mutex_unlock(&fs->ns_lock);
+		return -1;
 	}
 
 	//at this point, j == the open filedes spot
 	//initialize the file descriptor
-	fs_fd_init(j, filename);
-	fd_total++;
+	fs_fd_init(fs, j, fsrd);
+	fs->fd_total++;
+	pthread_mutex_unlock(&fs->ns_lock);
 
 	return j;
 }
 
-int fs_close(int fd)
+static int do_close(fs_t *fs, int fd)
 {
 	//make sure file system is mounted
-	if (FS_Mount==0) {
+	if (fs==NULL) {
 		return -1;
 	}
 
@@ -391,449 +907,2102 @@ int fs_close(int fd)
 		return -1;
 	}
 
-	if ((filedes[fd].fd_filename[0]=='\0')) {
+	pthread_mutex_lock(&fs->ns_lock);
+
+	if (fs->filedes[fd].fd_rd == RD_NONE) {
+		pthread_mutex_unlock(&fs->ns_lock);
+		return -1;
+	}
+
+	//asynchronous requests still use the fd
+	pthread_mutex_lock(&fs->aio_lock);
+	int busy = fs->filedes[fd].fd_aio > 0;
+	pthread_mutex_unlock(&fs->aio_lock);
+
+	//write the deferred directory updates
+	if (busy || update_RD(fs)) {
+		pthread_mutex_unlock(&fs->ns_lock);
 		return -1;
 	}
 
+	//drop the fd's reference to the file's block map
+	bmap_put(fs, fs->filedes[fd].fd_rd);
+
 	//set fd to empty value
-	filedes[fd].fd_filename[0]='\0';
-	fd_total--;
+	fs->filedes[fd].fd_rd = RD_NONE;
+	fs->fd_total--;
+	pthread_mutex_unlock(&fs->ns_lock);
 	return 0;
 	
 }
 
-int fs_stat(int fd)
+static int do_fsync(fs_t *fs, int fd)
 {
 	//make sure file system is mounted
-	if (FS_Mount==0) {
+	if (fs==NULL) {
 		return -1;
 	}
 
-	//make fd is valid
-	if (FS_OPEN_MAX_COUNT<=fd||fd<0) {
+	//make sure file descriptor exists
+	if (fd_exists(fs, fd)) {
 		return -1;
 	}
 
-	if ((fd_exists(fd))) {
+	//the file's chain, its directory entry, then its data
+	if (update_FAT(fs)) {
 		return -1;
-	} else {
-		//iterate through RD to find the file
-		//corresponding to fd
-		for (int i=0; i<FS_FILE_MAX_COUNT;i++) {
-			//if file is found, return its size
-			if (strcmp(RD[i].fname,filedes[fd].fd_filename)==0) {
-				return RD[i].fSize;
-			}
-			
-		}
-		
-	}	
-	//fd does not exist
-	return -1;
+	}
+
+	if (update_RD(fs)) {
+		return -1;
+	}
+
+	if (disk_sync(fs->disk)) {
+		return -1;
+	}
+
+	return 0;
 }
 
-int fs_lseek(int fd, size_t offset)
+static int do_set_writethrough(fs_t *fs, int fd, int enable)
 {
-	//make sure file system has been mounted
-	if (FS_Mount==0) {
+	//make sure file system is mounted
+	if (fs==NULL) {
 		return -1;
 	}
 
 	//make sure file descriptor exists
-	if (fd_exists(fd)) {
+	if (fd_exists(fs, fd)) {
 		return -1;
 	}
 
-	//get the root directory index of the file
-	//reffered to by fd
-	int rd_index=return_rd(filedes[fd].fd_filename);
+	fs->filedes[fd].fd_sync = enable ? 1 : 0;
+	return 0;
+}
 
-	//make sure offset isn't greater than file size
-	if (offset>RD[rd_index].fSize||rd_index<0) {
+static int do_set_writeback(fs_t *fs, unsigned int expire_ms,
+			    unsigned int background_ratio,
+			    unsigned int dirty_ratio)
+{
+	//make sure file system is mounted with a flusher
+	if (fs==NULL || !fs->flush_running) {
 		return -1;
 	}
 
-	//if file exists and its size is equal to or greater
-	//than offset
-	filedes[fd].fd_offset = offset;
-	return 0;
+	return flusher_tune(fs, expire_ms, background_ratio, dirty_ratio);
 }
 
-int fs_write(int fd, void *buf, size_t count)
+static int do_stat(fs_t *fs, int fd)
 {
-	//Error checking before the writes
-	if (fd > FS_OPEN_MAX_COUNT) {
+	int64_t size = do_stat64(fs, fd);
+
+	//the size must fit in the return value
+	if (size > INT_MAX) {
 		return -1;
 	}
 
-	if (fd_exists(fd)) {
+	return size;
+}
+
+static int64_t do_stat64(fs_t *fs, int fd)
+{
+	//make sure file system is mounted
+	if (fs==NULL) {
 		return -1;
 	}
 
-	//The bounce buffer for cases where we need to preserve existing data
-	void *bounce_buf = malloc(BLOCK_SIZE);
+	//make fd is valid
+	if (FS_OPEN_MAX_COUNT<=fd||fd<0) {
+		return -1;
+	}
 
-	//These variables reflect the status of the file
-	int file_offset = filedes[fd].fd_offset;
-	int block_offset = file_offset % BLOCK_SIZE;
-	int fsrd = return_rd(filedes[fd].fd_filename);
-
-	//These variables are for coordinating the write itself
-	uint16_t end_offset = 0;
-	uint16_t start_offset = 0;
-	uint32_t ext_blocks = 0;
-	int buf_index = 0;
-	int write_amt = 0;
-	int bytes_remaining = count;
-
-	//Integer division in C returns the floor
-	//The block number in the chain which corresponds to the file offset
-	int target_blocknum = filedes[fd].fd_offset / BLOCK_SIZE;
-
-	//Current = the first index of the file pointed at by fd
-	uint16_t firstblock = RD[fsrd].f_index;
-
-
-	//If the file needs to be intialized
-	if (firstblock == FAT_EOC) {
-		int nextb = next_block();
-		if (nextb == -1) {
-			//No more data blocks to append
-			return 0;
-		} else {
-			RD[fsrd].f_index = nextb;
-			fat->f_table[nextb] = FAT_EOC;
-			firstblock = nextb;
-		}
+	//fd does not exist
+	if ((fd_exists(fs, fd))) {
+		return -1;
 	}
 
-	//Current block in the chain
-	uint16_t curblock = firstblock;
+	//the fd refers to its file's RD entry directly
+	int fsrd = fs->filedes[fd].fd_rd;
+	file_lock(fs, fsrd, 0);
+	int64_t size = fs->RD[fsrd].fSize;
+	file_unlock(fs, fsrd);
 
-	int filesize = RD[fsrd].fSize;
+	return size;
+}
 
-	//Cycles through the fat and finds the index target_block in file des fd
-	for (int i = 0; i < target_blocknum; i++) {
-		curblock = fat->f_table[curblock];
+static int do_lseek(fs_t *fs, int fd, size_t offset)
+{
+	//make sure file system has been mounted
+	if (fs==NULL) {
+		return -1;
 	}
 
-	do {
-		if (curblock == firstblock) {
-			start_offset = block_offset;
-		} else {
-			start_offset = 0;
-		}
-
-		//if writing less than block, write amt needed
-		if (bytes_remaining < BLOCK_SIZE) {
-			end_offset = bytes_remaining - 1;
-		} else {
-			//if writing more than block, write to whole block
-			end_offset = BLOCK_SIZE - 1;
-		}
+	//make sure file descriptor exists
+	if (fd_exists(fs, fd)) {
+		return -1;
+	}
 
-		write_amt = end_offset - start_offset + 1;
+	//get the root directory index of the file
+	//reffered to by fd
+	int rd_index=fs->filedes[fd].fd_rd;
 
-		//If writing to the whole block, don't need to use a bounce buffer
-		if (write_amt == BLOCK_SIZE) {
-			if (block_write(curblock + SB->d_block_start, buf + buf_index)) {
-				return -1;
-			}
-		} else {
-			if (block_read(curblock + SB->d_block_start, bounce_buf)) {
-				return -1;
-			}
+	//make sure offset isn't greater than file size
+	file_lock(fs, rd_index, 0);
+	int past_end = offset>fs->RD[rd_index].fSize;
+	file_unlock(fs, rd_index);
+	if (past_end) {
+		return -1;
+	}
 
-			memcpy(bounce_buf + start_offset, buf + buf_index, write_amt);
+	//if file exists and its size is equal to or greater
+	//than offset
+	pthread_mutex_lock(&fs->filedes[fd].fd_lock);
+	fs->filedes[fd].fd_offset = offset;
+	pthread_mutex_unlock(&fs->filedes[fd].fd_lock);
+	return 0;
+}
+
+static int do_write(fs_t *fs, int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fd_writev(fs, fd, &iov, 1, count);
+}
+
+static int do_writev(fs_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+	size_t count;
+
+	if (iov_total(iov, iovcnt, &count)) {
+		return -1;
+	}
+
+	return fd_writev(fs, fd, iov, iovcnt, count);
+}
+
+//write the count bytes described by iov at the file offset of fd, and move
+//the offset past them
+static int fd_writev(fs_t *fs, int fd, const struct iovec *iov, int iovcnt,
+		     size_t count)
+{
+	//Error checking before the writes
+	if (fs==NULL || fd_exists(fs, fd)) {
+		return -1;
+	}
+
+	struct fs_filedes * f = &fs->filedes[fd];
+	int fsrd = f->fd_rd;
+	file_lock(fs, fsrd, 1);
+
+	pthread_mutex_lock(&f->fd_lock);
+	size_t offset = f->fd_offset;
+	pthread_mutex_unlock(&f->fd_lock);
+
+	int written = file_write_at(fs, fd, iov, iovcnt, count, offset, NULL);
+
+	if (written > 0) {
+		pthread_mutex_lock(&f->fd_lock);
+		f->fd_offset += written;
+		pthread_mutex_unlock(&f->fd_lock);
+	}
+
+	file_unlock(fs, fsrd);
+
+	//don't let the cache fill up before the flusher notices
+	flusher_kick(fs);
+	return written;
+}
+
+static int do_read(fs_t *fs, int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fd_readv(fs, fd, &iov, 1, count);
+}
+
+static int do_readv(fs_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+	size_t count;
+
+	if (iov_total(iov, iovcnt, &count)) {
+		return -1;
+	}
+
+	return fd_readv(fs, fd, iov, iovcnt, count);
+}
+
+//read up to count bytes at the file offset of fd into the buffers described
+//by iov, and move the offset past them
+static int fd_readv(fs_t *fs, int fd, const struct iovec *iov, int iovcnt,
+		    size_t count)
+{
+	//fd is out of bounds or not currently open
+	if (fs==NULL || fd_exists(fs, fd)) {
+		return -1;
+	}
+
+	struct fs_filedes * f = &fs->filedes[fd];
+	int fsrd = f->fd_rd;
+	file_lock(fs, fsrd, 0);
+
+	//get the blocks after this read coming before they are needed. Other
+	//readers may share fd and only hold the file's lock too
+	pthread_mutex_lock(&f->fd_lock);
+	size_t offset = f->fd_offset;
+	file_readahead(fs, fd, offset, count);
+	pthread_mutex_unlock(&f->fd_lock);
+
+	int nread = file_read_at(fs, fd, iov, iovcnt, count, offset, NULL);
+
+	//need to use nread because count could exceed the size of the file
+	if (nread > 0) {
+		pthread_mutex_lock(&f->fd_lock);
+		f->fd_offset += nread;
+		pthread_mutex_unlock(&f->fd_lock);
+	}
+	file_unlock(fs, fsrd);
+
+	return nread;
+}
+
+static int do_pread(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
+{
+	//fd is out of bounds or not currently open
+	if (fs==NULL || fd_exists(fs, fd)) {
+		return -1;
+	}
+
+	//neither the file offset nor the readahead state of fd are used, so
+	//readers sharing fd only share the file's lock
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	int fsrd = fs->filedes[fd].fd_rd;
+	file_lock(fs, fsrd, 0);
+	int nread = file_read_at(fs, fd, &iov, 1, count, offset, NULL);
+	file_unlock(fs, fsrd);
+
+	return nread;
+}
+
+static int do_pwrite(fs_t *fs, int fd, const void *buf, size_t count,
+		     size_t offset)
+{
+	//fd is out of bounds or not currently open
+	if (fs==NULL || fd_exists(fs, fd)) {
+		return -1;
+	}
+
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+	int fsrd = fs->filedes[fd].fd_rd;
+	file_lock(fs, fsrd, 1);
+	int written = file_write_at(fs, fd, &iov, 1, count, offset, NULL);
+	file_unlock(fs, fsrd);
+
+	//don't let the cache fill up before the flusher notices
+	flusher_kick(fs);
+	return written;
+}
+
+static int do_aio_setup(fs_t *fs, unsigned int depth, int flags)
+{
+	//make sure file system is mounted
+	if (fs==NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->aio_lock);
+	if (fs->aio.active ||
+	    disk_aio_setup(fs->disk, depth, (flags & FS_AIO_THREADS) ? BLOCK_AIO_THREADS : 0)) {
+		pthread_mutex_unlock(&fs->aio_lock);
+		return -1;
+	}
+
+	fs->aio.active = 1;
+	pthread_mutex_unlock(&fs->aio_lock);
+	return 0;
+}
+
+static int do_aio_teardown(fs_t *fs)
+{
+	struct fs_aio_event event;
+
+	if (fs==NULL) {
+		return -1;
+	}
+
+	//wait for every request, dropping the completions nobody polled
+	pthread_mutex_lock(&fs->aio_lock);
+	while (fs->aio.active && fs->aio.inflight > 0) {
+		pthread_mutex_unlock(&fs->aio_lock);
+		do_aio_poll(fs, &event, 1, 1);
+		pthread_mutex_lock(&fs->aio_lock);
+	}
+
+	//a poller may still be leaving the block engine
+	while (fs->aio.reaping) {
+		pthread_cond_wait(&fs->aio.reap_cond, &fs->aio_lock);
+	}
+
+	int ret = -1;
+	if (fs->aio.active) {
+		fs->aio.active = 0;
+		ret = disk_aio_teardown(fs->disk);
+	}
+	pthread_mutex_unlock(&fs->aio_lock);
+
+	return ret;
+}
+
+static int do_read_async(fs_t *fs, int fd, void *buf, size_t count,
+			 size_t offset, void *user)
+{
+	if (fs==NULL || fd_exists(fs, fd)) {
+		return -1;
+	}
+
+	int fsrd = fs->filedes[fd].fd_rd;
+	file_lock(fs, fsrd, 0);
+
+	struct Aio_Req * req = aio_req_new(fs, fd, user);
+	if (req == NULL) {
+		file_unlock(fs, fsrd);
+		return -1;
+	}
+
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	req->result = file_read_at(fs, fd, &iov, 1, count, offset, req);
+	file_unlock(fs, fsrd);
+
+	pthread_mutex_lock(&fs->aio_lock);
+	aio_req_put(fs, req);
+	pthread_mutex_unlock(&fs->aio_lock);
+
+	return 0;
+}
+
+static int do_write_async(fs_t *fs, int fd, const void *buf, size_t count,
+			  size_t offset, void *user)
+{
+	if (fs==NULL || fd_exists(fs, fd)) {
+		return -1;
+	}
+
+	int fsrd = fs->filedes[fd].fd_rd;
+	file_lock(fs, fsrd, 1);
+
+	//writes can't leave a hole in the file
+	struct Aio_Req * req = NULL;
+	if (offset <= fs->RD[fsrd].fSize) {
+		req = aio_req_new(fs, fd, user);
+	}
+	if (req == NULL) {
+		file_unlock(fs, fsrd);
+		return -1;
+	}
+
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+	req->result = file_write_at(fs, fd, &iov, 1, count, offset, req);
+	file_unlock(fs, fsrd);
+
+	pthread_mutex_lock(&fs->aio_lock);
+	aio_req_put(fs, req);
+	pthread_mutex_unlock(&fs->aio_lock);
+
+	return 0;
+}
+
+static int do_aio_poll(fs_t *fs, struct fs_aio_event *events, int max, int min)
+{
+	struct block_aio_event bevents[16];
+	int n = 0;
+
+	if (fs==NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->aio_lock);
+	if (!fs->aio.active) {
+		pthread_mutex_unlock(&fs->aio_lock);
+		return -1;
+	}
+
+	//can't wait for more requests than there are
+	if (min > fs->aio.inflight) {
+		min = fs->aio.inflight;
+	}
+
+	while (n < max) {
+		struct Aio_Req * req = fs->aio.done_head;
+
+		if (req == NULL) {
+			int wait = n < min;
 
-			if (block_write(curblock + SB->d_block_start, bounce_buf)) {
-				return -1;
+			//only one poller collects block completions, the others
+			//wait for it to queue them
+			if (fs->aio.reaping) {
+				if (!wait) {
+					break;
+				}
+				pthread_cond_wait(&fs->aio.reap_cond, &fs->aio_lock);
+				continue;
 			}
+
+			//turn block completions into request completions,
+			//waiting for one if more requests are needed. Requests
+			//can still be submitted meanwhile
+			fs->aio.reaping = 1;
+			if (wait) {
+				pthread_mutex_unlock(&fs->aio_lock);
+			}
+			int got = disk_aio_reap(fs->disk, bevents, 16, wait);
+			if (wait) {
+				pthread_mutex_lock(&fs->aio_lock);
+			}
+			fs->aio.reaping = 0;
+			pthread_cond_broadcast(&fs->aio.reap_cond);
+
+			for (int i = 0; i < got; i++) {
+				req = bevents[i].user;
+				if (bevents[i].result) {
+					req->result = -1;
+				}
+				aio_req_put(fs, req);
+			}
+
+			if (got <= 0 && fs->aio.done_head == NULL) {
+				break;
+			}
+			continue;
 		}
-		
 
-		//cleanup for next iteration
-		bytes_remaining -= write_amt;
-		buf_index += write_amt;
-
-		//check if the file needs to be extended
-		if (fat->f_table[curblock] == FAT_EOC && bytes_remaining > 0) {
-			ext_blocks = file_extend(fd, ceilingdiv(bytes_remaining, BLOCK_SIZE));
-			
-			//If writing more than is available after extension, write as much
-			//as possible
-			if (bytes_remaining > ext_blocks * BLOCK_SIZE) {
-				bytes_remaining = ext_blocks * BLOCK_SIZE;
+		fs->aio.done_head = req->next;
+		if (fs->aio.done_head == NULL) {
+			fs->aio.done_tail = NULL;
+		}
+
+		//a write grows its file once all of its data is on disk. The
+		//file's lock must be taken before aio_lock
+		if (req->result >= 0 && req->end > 0) {
+			int fsrd = fs->filedes[req->fd].fd_rd;
+
+			pthread_mutex_unlock(&fs->aio_lock);
+			file_lock(fs, fsrd, 1);
+			if (file_grow(fs, req->fd, req->end)) {
+				req->result = -1;
+			}
+			file_unlock(fs, fsrd);
+			pthread_mutex_lock(&fs->aio_lock);
+		}
+		fs->filedes[req->fd].fd_aio--;
+
+		events[n].user = req->user;
+		events[n].result = req->result;
+		n++;
+		fs->aio.inflight--;
+		free(req);
+	}
+
+	pthread_mutex_unlock(&fs->aio_lock);
+	return n;
+}
+
+static int do_fallocate(fs_t *fs, int fd, size_t len)
+{
+	//make sure file system is mounted
+	if (fs==NULL) {
+		return -1;
+	}
+
+	//make sure file descriptor exists
+	if (fd_exists(fs, fd)) {
+		return -1;
+	}
+
+	int fsrd = fs->filedes[fd].fd_rd;
+	struct Block_Map * map = &fs->bmap[fsrd];
+	size_t need_blocks = len ? ceilingdiv(len, fs->SB->block_size) : 0;
+	int ret = 0;
+
+	file_lock(fs, fsrd, 1);
+	pthread_mutex_lock(&fs->alloc_lock);
+
+	//the file already holds enough blocks
+	//all or nothing: don't reserve part of the range
+	if (need_blocks <= map->count) {
+		need_blocks = 0;
+	} else if (need_blocks - map->count > (size_t)free_FAT_blocks(fs)) {
+		need_blocks = 0;
+		ret = -1;
+	} else {
+		need_blocks -= map->count;
+	}
+
+	//an empty file can start wherever the best fitting run is
+	if (need_blocks > 0 && map->count == 0) {
+		uint32_t start;
+		size_t run = alloc_run(fs, 0, need_blocks, &start);
+
+		if (chain_add_run(fs, fsrd, start, run)) {
+			for (size_t i = 0; i < run; i++) {
+				fmap_release(fs, start + i);
 			}
+			need_blocks = 0;
+			ret = -1;
+		} else {
+			need_blocks -= run;
+		}
+	}
+
+	if (need_blocks > 0 && file_extend(fs, fd, need_blocks) < need_blocks) {
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&fs->alloc_lock);
+	file_unlock(fs, fsrd);
+
+	if (ret) {
+		return -1;
+	}
+
+	//the first data block may have changed
+	if (fs->filedes[fd].fd_sync && update_RD(fs)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+//count @nblocks more blocks pinned by views, unless that would take more
+//than half the block cache. Views of a mapped disk are not limited
+static int view_reserve(fs_t *fs, size_t nblocks)
+{
+	struct block_cache_stats stats;
+
+	if (disk_map(fs->disk, 0) != NULL) {
+		return 0;
+	}
+	if (disk_cache_stats(fs->disk, &stats)) {
+		return -1;
+	}
+
+	size_t used = __atomic_load_n(&fs->view_blocks, __ATOMIC_RELAXED);
+	do {
+		if (used > stats.size / 2 || nblocks > stats.size / 2 - used) {
+			return -1;
 		}
+	} while (!__atomic_compare_exchange_n(&fs->view_blocks, &used, used + nblocks, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+static void view_unreserve(fs_t *fs, size_t nblocks)
+{
+	if (disk_map(fs->disk, 0) == NULL) {
+		__atomic_fetch_sub(&fs->view_blocks, nblocks, __ATOMIC_RELAXED);
+	}
+}
+
+static int do_read_view(fs_t *fs, int fd, size_t offset, size_t count,
+			struct fs_view *view)
+{
+	//make sure file system is mounted
+	if (fs==NULL) {
+		return -1;
+	}
+
+	//make sure file descriptor exists
+	if (fd_exists(fs, fd) || view == NULL) {
+		return -1;
+	}
 
-		curblock = fat->f_table[curblock];
+	int fsrd = fs->filedes[fd].fd_rd;
+	struct Block_Map * map = &fs->bmap[fsrd];
+
+	file_lock(fs, fsrd, 0);
+	size_t filesize = fs->RD[fsrd].fSize;
+
+	view->iov = NULL;
+	view->iovcnt = 0;
+	view->len = 0;
+	view->blocks = NULL;
+	view->nblocks = 0;
+
+	//the view stops at the end of the file
+	if (offset >= filesize || count == 0) {
+		file_unlock(fs, fsrd);
+		return 0;
+	}
+	if (count > filesize - offset) {
+		count = filesize - offset;
+	}
+
+	size_t first = offset / fs->SB->block_size;
+	size_t nblocks = (offset + count - 1) / fs->SB->block_size - first + 1;
+
+	//each block of a view holds a cache slot until it is released, so views
+	//together may only pin half the cache, leaving the rest for other reads
+	//and writes. Mapped blocks don't use the cache
+	if (view_reserve(fs, nblocks)) {
+		file_unlock(fs, fsrd);
+		return -1;
+	}
 
-	} while (bytes_remaining > 0);
+	view->iov = malloc(nblocks * sizeof(struct iovec));
+	view->blocks = malloc(nblocks * sizeof(size_t));
+	if (view->iov == NULL || view->blocks == NULL) {
+		view_unreserve(fs, nblocks);
+		do_release_view(fs, view);
+		file_unlock(fs, fsrd);
+		return -1;
+	}
 
-	filedes[fd].fd_offset = filedes[fd].fd_offset + buf_index;
+	while (view->len < count) {
+		size_t idx = (offset + view->len) / fs->SB->block_size;
+		size_t start_offset = (offset + view->len) % fs->SB->block_size;
+		size_t disk_block = map->blocks[idx] + fs->SB->d_block_start;
+		const char * data = disk_pin(fs->disk, disk_block);
 
-	//if we wrote additional blocks to file
-	if (filesize < file_offset + buf_index) {
-		RD[fsrd].fSize = file_offset + buf_index;
-		if (update_RD()) {
+		if (data == NULL) {
+			view_unreserve(fs, nblocks - view->nblocks);
+			do_release_view(fs, view);
+			file_unlock(fs, fsrd);
 			return -1;
 		}
+		view->blocks[view->nblocks++] = disk_block;
+
+		size_t seg_len = fs->SB->block_size - start_offset;
+		if (seg_len > count - view->len) {
+			seg_len = count - view->len;
+		}
+
+		//blocks which follow each other in memory (in a mapped disk)
+		//share a segment
+		struct iovec * last = view->iovcnt ? &view->iov[view->iovcnt - 1] : NULL;
+		if (last && (const char *)last->iov_base + last->iov_len == data + start_offset) {
+			last->iov_len += seg_len;
+		} else {
+			view->iov[view->iovcnt].iov_base = (void *)(data + start_offset);
+			view->iov[view->iovcnt].iov_len = seg_len;
+			view->iovcnt++;
+		}
+
+		view->len += seg_len;
+	}
+
+	file_unlock(fs, fsrd);
+	return view->len;
+}
+
+static int do_release_view(fs_t *fs, struct fs_view *view)
+{
+	if (fs==NULL || view == NULL) {
+		return -1;
+	}
+
+	int ret = 0;
+
+	//unpin every block the view references
+	for (size_t i = 0; i < view->nblocks; i++) {
+		if (disk_unpin(fs->disk, view->blocks[i])) {
+			ret = -1;
+		}
+	}
+
+	view_unreserve(fs, view->nblocks);
+	free(view->iov);
+	free(view->blocks);
+	view->iov = NULL;
+	view->iovcnt = 0;
+	view->len = 0;
+	view->blocks = NULL;
+	view->nblocks = 0;
+
+	return ret;
+}
+
+//instrumented entry points, timing and counting each call to the
+//implementation of a public operation and labeling its block transfers
+
+fs_t * fs_mount_ctx(const char *diskname, int flags)
+{
+	OP_START(FS_OP_MOUNT, start);
+	fs_t *fs = do_mount(diskname, flags);
+	OP_END(FS_OP_MOUNT, start, fs == NULL, 0);
+	return fs;
+}
+
+int fs_umount_ctx(fs_t *fs)
+{
+	OP_START(FS_OP_UMOUNT, start);
+	int ret = do_umount(fs);
+	OP_END(FS_OP_UMOUNT, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_sync_ctx(fs_t *fs)
+{
+	OP_START(FS_OP_SYNC, start);
+	int ret = do_sync(fs);
+	OP_END(FS_OP_SYNC, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_info_ctx(fs_t *fs)
+{
+	OP_START(FS_OP_INFO, start);
+	int ret = do_info(fs);
+	OP_END(FS_OP_INFO, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_create_ctx(fs_t *fs, const char *filename)
+{
+	OP_START(FS_OP_CREATE, start);
+	int ret = do_create(fs, filename);
+	OP_END(FS_OP_CREATE, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_delete_ctx(fs_t *fs, const char *filename)
+{
+	OP_START(FS_OP_DELETE, start);
+	int ret = do_delete(fs, filename);
+	OP_END(FS_OP_DELETE, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_create_many_ctx(fs_t *fs, const char **filenames, int count,
+		       int *results)
+{
+	OP_START(FS_OP_CREATE_MANY, start);
+	int ret = do_create_many(fs, filenames, count, results);
+	OP_END(FS_OP_CREATE_MANY, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_delete_many_ctx(fs_t *fs, const char **filenames, int count,
+		       int *results)
+{
+	OP_START(FS_OP_DELETE_MANY, start);
+	int ret = do_delete_many(fs, filenames, count, results);
+	OP_END(FS_OP_DELETE_MANY, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_ls_ctx(fs_t *fs)
+{
+	OP_START(FS_OP_LS, start);
+	int ret = do_ls(fs);
+	OP_END(FS_OP_LS, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_open_ctx(fs_t *fs, const char *filename)
+{
+	OP_START(FS_OP_OPEN, start);
+	int ret = do_open(fs, filename);
+	OP_END(FS_OP_OPEN, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_close_ctx(fs_t *fs, int fd)
+{
+	OP_START(FS_OP_CLOSE, start);
+	int ret = do_close(fs, fd);
+	OP_END(FS_OP_CLOSE, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_fsync_ctx(fs_t *fs, int fd)
+{
+	OP_START(FS_OP_FSYNC, start);
+	int ret = do_fsync(fs, fd);
+	OP_END(FS_OP_FSYNC, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_set_writethrough_ctx(fs_t *fs, int fd, int enable)
+{
+	OP_START(FS_OP_SET_WRITETHROUGH, start);
+	int ret = do_set_writethrough(fs, fd, enable);
+	OP_END(FS_OP_SET_WRITETHROUGH, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_set_writeback_ctx(fs_t *fs, unsigned int expire_ms,
+			 unsigned int background_ratio, unsigned int dirty_ratio)
+{
+	OP_START(FS_OP_SET_WRITEBACK, start);
+	int ret = do_set_writeback(fs, expire_ms, background_ratio, dirty_ratio);
+	OP_END(FS_OP_SET_WRITEBACK, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_stat_ctx(fs_t *fs, int fd)
+{
+	OP_START(FS_OP_STAT, start);
+	int ret = do_stat(fs, fd);
+	OP_END(FS_OP_STAT, start, ret < 0, 0);
+	return ret;
+}
+
+int64_t fs_stat64_ctx(fs_t *fs, int fd)
+{
+	OP_START(FS_OP_STAT64, start);
+	int64_t ret = do_stat64(fs, fd);
+	OP_END(FS_OP_STAT64, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_lseek_ctx(fs_t *fs, int fd, size_t offset)
+{
+	OP_START(FS_OP_LSEEK, start);
+	int ret = do_lseek(fs, fd, offset);
+	OP_END(FS_OP_LSEEK, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_write_ctx(fs_t *fs, int fd, void *buf, size_t count)
+{
+	OP_START(FS_OP_WRITE, start);
+	int ret = do_write(fs, fd, buf, count);
+	OP_END(FS_OP_WRITE, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fs_read_ctx(fs_t *fs, int fd, void *buf, size_t count)
+{
+	OP_START(FS_OP_READ, start);
+	int ret = do_read(fs, fd, buf, count);
+	OP_END(FS_OP_READ, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fs_writev_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+	OP_START(FS_OP_WRITEV, start);
+	int ret = do_writev(fs, fd, iov, iovcnt);
+	OP_END(FS_OP_WRITEV, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fs_readv_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+	OP_START(FS_OP_READV, start);
+	int ret = do_readv(fs, fd, iov, iovcnt);
+	OP_END(FS_OP_READV, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fs_pread_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset)
+{
+	OP_START(FS_OP_PREAD, start);
+	int ret = do_pread(fs, fd, buf, count, offset);
+	OP_END(FS_OP_PREAD, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fs_pwrite_ctx(fs_t *fs, int fd, const void *buf, size_t count,
+		  size_t offset)
+{
+	OP_START(FS_OP_PWRITE, start);
+	int ret = do_pwrite(fs, fd, buf, count, offset);
+	OP_END(FS_OP_PWRITE, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fs_read_view_ctx(fs_t *fs, int fd, size_t offset, size_t count,
+		     struct fs_view *view)
+{
+	OP_START(FS_OP_READ_VIEW, start);
+	int ret = do_read_view(fs, fd, offset, count, view);
+	OP_END(FS_OP_READ_VIEW, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fs_release_view_ctx(fs_t *fs, struct fs_view *view)
+{
+	OP_START(FS_OP_RELEASE_VIEW, start);
+	int ret = do_release_view(fs, view);
+	OP_END(FS_OP_RELEASE_VIEW, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_fallocate_ctx(fs_t *fs, int fd, size_t len)
+{
+	OP_START(FS_OP_FALLOCATE, start);
+	int ret = do_fallocate(fs, fd, len);
+	OP_END(FS_OP_FALLOCATE, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_aio_setup_ctx(fs_t *fs, unsigned int depth, int flags)
+{
+	OP_START(FS_OP_AIO_SETUP, start);
+	int ret = do_aio_setup(fs, depth, flags);
+	OP_END(FS_OP_AIO_SETUP, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_aio_teardown_ctx(fs_t *fs)
+{
+	OP_START(FS_OP_AIO_TEARDOWN, start);
+	int ret = do_aio_teardown(fs);
+	OP_END(FS_OP_AIO_TEARDOWN, start, ret < 0, 0);
+	return ret;
+}
+
+int fs_read_async_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset,
+		      void *user)
+{
+	OP_START(FS_OP_READ_ASYNC, start);
+	int ret = do_read_async(fs, fd, buf, count, offset, user);
+	OP_END(FS_OP_READ_ASYNC, start, ret < 0, ret == 0 ? count : 0);
+	return ret;
+}
+
+int fs_write_async_ctx(fs_t *fs, int fd, const void *buf, size_t count,
+		       size_t offset, void *user)
+{
+	OP_START(FS_OP_WRITE_ASYNC, start);
+	int ret = do_write_async(fs, fd, buf, count, offset, user);
+	OP_END(FS_OP_WRITE_ASYNC, start, ret < 0, ret == 0 ? count : 0);
+	return ret;
+}
+
+int fs_aio_poll_ctx(fs_t *fs, struct fs_aio_event *events, int max, int min)
+{
+	OP_START(FS_OP_AIO_POLL, start);
+	int ret = do_aio_poll(fs, events, max, min);
+	OP_END(FS_OP_AIO_POLL, start, ret < 0, 0);
+	return ret;
+}
+
+static const char * const op_names[FS_OP_COUNT] = {
+	[FS_OP_MOUNT] = "mount",
+	[FS_OP_UMOUNT] = "umount",
+	[FS_OP_SYNC] = "sync",
+	[FS_OP_INFO] = "info",
+	[FS_OP_CREATE] = "create",
+	[FS_OP_DELETE] = "delete",
+	[FS_OP_LS] = "ls",
+	[FS_OP_OPEN] = "open",
+	[FS_OP_CLOSE] = "close",
+	[FS_OP_FSYNC] = "fsync",
+	[FS_OP_SET_WRITETHROUGH] = "set_writethrough",
+	[FS_OP_SET_WRITEBACK] = "set_writeback",
+	[FS_OP_STAT] = "stat",
+	[FS_OP_LSEEK] = "lseek",
+	[FS_OP_WRITE] = "write",
+	[FS_OP_READ] = "read",
+	[FS_OP_READ_VIEW] = "read_view",
+	[FS_OP_RELEASE_VIEW] = "release_view",
+	[FS_OP_FALLOCATE] = "fallocate",
+	[FS_OP_AIO_SETUP] = "aio_setup",
+	[FS_OP_AIO_TEARDOWN] = "aio_teardown",
+	[FS_OP_READ_ASYNC] = "read_async",
+	[FS_OP_WRITE_ASYNC] = "write_async",
+	[FS_OP_AIO_POLL] = "aio_poll",
+	[FS_OP_CREATE_MANY] = "create_many",
+	[FS_OP_DELETE_MANY] = "delete_many",
+	[FS_OP_WRITEV] = "writev",
+	[FS_OP_READV] = "readv",
+	[FS_OP_PREAD] = "pread",
+	[FS_OP_PWRITE] = "pwrite",
+	[FS_OP_STAT64] = "stat64",
+};
+
+const char *fs_op_name(int op)
+{
+	if (op < 0 || op >= FS_OP_COUNT) {
+		return NULL;
+	}
+	return op_names[op];
+}
+
+#ifndef NO_STATS
+//upper bound of the histogram bucket holding the given fraction of the calls
+static uint64_t stats_percentile(const uint64_t *hist, uint64_t calls, int pct)
+{
+	uint64_t seen = 0;
+
+	for (int i = 0; i < FS_STATS_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen * 100 >= calls * pct) {
+			return i ? (uint64_t)1 << i : 0;
+		}
+	}
+	return (uint64_t)1 << (FS_STATS_BUCKETS - 1);
+}
+#endif
+
+int fs_stats(struct fs_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+#ifndef NO_STATS
+	for (int op = 0; op < FS_OP_COUNT; op++) {
+		struct Op_Stats *os = &stats.ops[op];
+		struct fs_op_stats *out = &st->ops[op];
+
+		out->calls = __atomic_load_n(&os->calls, __ATOMIC_RELAXED);
+		out->errors = __atomic_load_n(&os->errors, __ATOMIC_RELAXED);
+		out->bytes = __atomic_load_n(&os->bytes, __ATOMIC_RELAXED);
+		out->max_ns = __atomic_load_n(&os->max_ns, __ATOMIC_RELAXED);
+		uint64_t total = 0;
+		for (int i = 0; i < FS_STATS_BUCKETS; i++) {
+			out->hist[i] = __atomic_load_n(&os->hist[i], __ATOMIC_RELAXED);
+			total += out->hist[i];
+		}
+		if (total) {
+			out->p50_ns = stats_percentile(out->hist, total, 50);
+			out->p99_ns = stats_percentile(out->hist, total, 99);
+		}
+		//a bucket bound can exceed the exact maximum
+		if (out->p50_ns > out->max_ns) {
+			out->p50_ns = out->max_ns;
+		}
+		if (out->p99_ns > out->max_ns) {
+			out->p99_ns = out->max_ns;
+		}
+	}
+	st->bounces = __atomic_load_n(&stats.bounces, __ATOMIC_RELAXED);
+	st->rmw = __atomic_load_n(&stats.rmw, __ATOMIC_RELAXED);
+	st->fat_flushed = __atomic_load_n(&stats.fat_flushed, __ATOMIC_RELAXED);
+
+	struct block_io_stats io;
+	block_io_stats(&io);
+	st->io.reads = io.reads;
+	st->io.writes = io.writes;
+	st->io.read_calls = io.read_calls;
+	st->io.write_calls = io.write_calls;
+	st->io.cache_hits = io.cache_hits;
+	st->io.cache_misses = io.cache_misses;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void fs_stats_reset(void)
+{
+#ifndef NO_STATS
+	//counters keep being updated meanwhile, a reset is not atomic
+	for (int op = 0; op < FS_OP_COUNT; op++) {
+		struct Op_Stats *os = &stats.ops[op];
+
+		__atomic_store_n(&os->calls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&os->errors, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&os->bytes, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&os->max_ns, 0, __ATOMIC_RELAXED);
+		for (int i = 0; i < FS_STATS_BUCKETS; i++) {
+			__atomic_store_n(&os->hist[i], 0, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&stats.bounces, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats.rmw, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats.fat_flushed, 0, __ATOMIC_RELAXED);
+	block_io_stats_reset();
+#endif
+}
+
+//default context wrappers, operating on the file system mounted with
+//fs_mount()
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_flags(diskname, 0);
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+	//only one file system can be mounted without a context
+	if (default_fs != NULL) {
+		return -1;
+	}
+
+	default_fs = fs_mount_ctx(diskname, flags);
+	if (default_fs == NULL) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	if (fs_umount_ctx(default_fs)) {
+		return -1;
+	}
+
+	default_fs = NULL;
+	return 0;
+}
+
+int fs_sync(void)
+{
+	return fs_sync_ctx(default_fs);
+}
+
+int fs_info(void)
+{
+	return fs_info_ctx(default_fs);
+}
+
+int fs_create(const char *filename)
+{
+	return fs_create_ctx(default_fs, filename);
+}
+
+int fs_delete(const char *filename)
+{
+	return fs_delete_ctx(default_fs, filename);
+}
+
+int fs_create_many(const char **filenames, int count, int *results)
+{
+	return fs_create_many_ctx(default_fs, filenames, count, results);
+}
+
+int fs_delete_many(const char **filenames, int count, int *results)
+{
+	return fs_delete_many_ctx(default_fs, filenames, count, results);
+}
+
+int fs_ls(void)
+{
+	return fs_ls_ctx(default_fs);
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_ctx(default_fs, filename);
+}
+
+int fs_close(int fd)
+{
+	return fs_close_ctx(default_fs, fd);
+}
+
+int fs_fsync(int fd)
+{
+	return fs_fsync_ctx(default_fs, fd);
+}
+
+int fs_set_writethrough(int fd, int enable)
+{
+	return fs_set_writethrough_ctx(default_fs, fd, enable);
+}
+
+int fs_set_writeback(unsigned int expire_ms, unsigned int background_ratio,
+		     unsigned int dirty_ratio)
+{
+	return fs_set_writeback_ctx(default_fs, expire_ms, background_ratio,
+				    dirty_ratio);
+}
+
+int fs_stat(int fd)
+{
+	return fs_stat_ctx(default_fs, fd);
+}
+
+int64_t fs_stat64(int fd)
+{
+	return fs_stat64_ctx(default_fs, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return fs_lseek_ctx(default_fs, fd, offset);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	return fs_write_ctx(default_fs, fd, buf, count);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	return fs_read_ctx(default_fs, fd, buf, count);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_writev_ctx(default_fs, fd, iov, iovcnt);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_readv_ctx(default_fs, fd, iov, iovcnt);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	return fs_pread_ctx(default_fs, fd, buf, count, offset);
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+	return fs_pwrite_ctx(default_fs, fd, buf, count, offset);
+}
+
+int fs_aio_setup(unsigned int depth, int flags)
+{
+	return fs_aio_setup_ctx(default_fs, depth, flags);
+}
+
+int fs_aio_teardown(void)
+{
+	return fs_aio_teardown_ctx(default_fs);
+}
+
+int fs_read_async(int fd, void *buf, size_t count, size_t offset, void *user)
+{
+	return fs_read_async_ctx(default_fs, fd, buf, count, offset, user);
+}
+
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset,
+		   void *user)
+{
+	return fs_write_async_ctx(default_fs, fd, buf, count, offset, user);
+}
+
+int fs_aio_poll(struct fs_aio_event *events, int max, int min)
+{
+	return fs_aio_poll_ctx(default_fs, events, max, min);
+}
+
+int fs_fallocate(int fd, size_t len)
+{
+	return fs_fallocate_ctx(default_fs, fd, len);
+}
+
+int fs_read_view(int fd, size_t offset, size_t count, struct fs_view *view)
+{
+	return fs_read_view_ctx(default_fs, fd, offset, count, view);
+}
+
+int fs_release_view(struct fs_view *view)
+{
+	return fs_release_view_ctx(default_fs, view);
+}
+
+//file transfer helper functions
+
+//write the count bytes described by iov at file_offset in the file open as
+//fd, extending the file if needed. If req isn't NULL, whole blocks are
+//written asynchronously on its behalf and the file grows when they complete.
+//The caller holds the file's lock exclusively.
+//returns the number of bytes written, or -1
+static int file_write_at(fs_t *fs, int fd, const struct iovec *iov,
+			 int iovcnt, size_t count, size_t file_offset,
+			 struct Aio_Req * req)
+{
+	//These variables reflect the status of the file
+	int fsrd = fs->filedes[fd].fd_rd;
+	size_t filesize = fs->RD[fsrd].fSize;
+	struct Block_Map * map = &fs->bmap[fsrd];
+
+	//writes can't leave a hole in the file
+	if (file_offset > filesize) {
+		return -1;
+	}
+
+	//Nothing to write, don't allocate anything
+	if (count == 0) {
+		return 0;
+	}
+
+	//the byte count is returned as an int
+	if (count > INT_MAX) {
+		count = INT_MAX;
+	}
+
+	//Extend the chain up front so that the blocks of the write are all
+	//known before the transfer, and can be grouped into runs. An empty
+	//file gets its first run from the best fitting free space too
+	size_t have_blocks = map->count;
+	size_t need_blocks = ceilingdiv(file_offset + count, fs->SB->block_size);
+	if (need_blocks > have_blocks) {
+		//a file can never hold more blocks than the disk has
+		if (need_blocks - have_blocks > fs->SB->nDataBlocks) {
+			need_blocks = have_blocks + fs->SB->nDataBlocks;
+		}
+		pthread_mutex_lock(&fs->alloc_lock);
+		have_blocks += file_extend(fs, fd, need_blocks - have_blocks);
+		pthread_mutex_unlock(&fs->alloc_lock);
+
+		//If writing more than is available after extension, write as much
+		//as possible
+		if (file_offset + count > have_blocks * fs->SB->block_size) {
+			count = have_blocks * fs->SB->block_size - file_offset;
+		}
+	}
+
+	if (file_xfer(fs, 1, map, iov, iovcnt, count, file_offset, filesize, req)) {
+		return -1;
+	}
+
+	//asynchronous writes only grow the file once their data is on disk
+	if (req != NULL) {
+		req->end = file_offset + count;
+	} else if (file_grow(fs, fd, file_offset + count)) {
+		return -1;
+	}
+
+	return count;
+}
+
+//read up to count bytes at file_offset in the file open as fd into the
+//buffers described by iov. If req isn't NULL, whole blocks are read
+//asynchronously on its behalf. The caller holds the file's lock.
+//returns the number of bytes read, or -1
+static int file_read_at(fs_t *fs, int fd, const struct iovec *iov, int iovcnt,
+			size_t count, size_t file_offset, struct Aio_Req * req)
+{
+	//Data about the file
+	int fsrd = fs->filedes[fd].fd_rd;
+	size_t filesize = fs->RD[fsrd].fSize;
+
+	//If desired read is longer than the file, read to end of file
+	if (file_offset >= filesize) {
+		return 0;
+	}
+	if (count > filesize - file_offset) {
+		count = filesize - file_offset;
+	}
+	if (count > INT_MAX) {
+		count = INT_MAX;
+	}
+
+	if (file_xfer(fs, 0, &fs->bmap[fsrd], iov, iovcnt, count, file_offset,
+		      filesize, req)) {
+		return -1;
+	}
+
+	return count;
+}
+
+//watch the reads of count bytes at offset on fd. While they follow each
+//other, the blocks after them are read into the block cache in the
+//background: a window of RA_MIN blocks at first, doubling up to RA_MAX each
+//time the reader got through half of what was read ahead.
+//The caller holds the file's lock and fd_lock
+static void file_readahead(fs_t *fs, int fd, size_t offset, size_t count)
+{
+	struct fs_filedes * f = &fs->filedes[fd];
+	struct Block_Map * map = &fs->bmap[f->fd_rd];
+	size_t first = offset / fs->SB->block_size;
+	size_t end = ceilingdiv(offset + count, fs->SB->block_size);
+	size_t file_blocks = ceilingdiv(fs->RD[f->fd_rd].fSize, fs->SB->block_size);
+
+	if (count == 0) {
+		return;
+	}
+
+	//a read starting in the block where the last one stopped is
+	//sequential, anything else starts over
+	if (first != f->fd_ra_next) {
+		f->fd_ra_size = 0;
+		f->fd_ra_end = 0;
+	} else if (f->fd_ra_size == 0) {
+		f->fd_ra_size = RA_MIN;
+	}
+	f->fd_ra_next = (offset + count) / fs->SB->block_size;
+
+	if (f->fd_ra_size == 0) {
+		return;
+	}
+
+	//the reader may have caught up with the blocks read ahead
+	if (f->fd_ra_end < end) {
+		f->fd_ra_end = end;
+	} else if (f->fd_ra_end - end > f->fd_ra_size / 2) {
+		return;
+	}
+
+	size_t stop = f->fd_ra_end + f->fd_ra_size;
+	if (stop > file_blocks) {
+		stop = file_blocks;
+	}
+	if (stop > map->count) {
+		stop = map->count;
+	}
+
+	//one hint per physically contiguous run of the chain
+	for (size_t i = f->fd_ra_end; i < stop; ) {
+		size_t run = bmap_run(map, i, stop - i);
+
+		disk_prefetch(fs->disk, map->blocks[i] + fs->SB->d_block_start, run);
+		i += run;
+	}
+
+	if (stop > f->fd_ra_end) {
+		f->fd_ra_end = stop;
+		if (f->fd_ra_size < RA_MAX) {
+			f->fd_ra_size *= 2;
+		}
+	}
+}
+
+//move the first count bytes of the buffers described by iov to or from the
+//file described by map, starting at file_offset. Unaligned head and tail
+//blocks go through a bounce buffer, whole blocks are moved in physically
+//contiguous runs straight from or to the buffers (asynchronously if req
+//isn't NULL and the engine accepts them)
+static int file_xfer(fs_t *fs, int write, struct Block_Map * map,
+		     const struct iovec *iov, int iovcnt, size_t count,
+		     size_t file_offset, size_t filesize, struct Aio_Req * req)
+{
+	size_t bsize = fs->SB->block_size;
+
+	//Index in the chain of the block holding the file offset
+	size_t curblock = file_offset / bsize;
+
+	//The bounce buffer for cases where we need to preserve existing data,
+	//and the buffers of the run being transferred
+	char *bounce_buf = malloc(bsize);
+	struct iovec local[8], *sub = local;
+	size_t buf_index = 0;
+
+	if (iovcnt > 8) {
+		sub = malloc(iovcnt * sizeof(struct iovec));
+	}
+	if (bounce_buf == NULL || sub == NULL) {
+		free(bounce_buf);
+		if (sub != local) {
+			free(sub);
+		}
+		return -1;
+	}
+
+	while (buf_index < count) {
+		size_t start_offset = (file_offset + buf_index) % bsize;
+		size_t bytes_remaining = count - buf_index;
+		size_t disk_block = map->blocks[curblock] + fs->SB->d_block_start;
+
+		if (start_offset != 0 || bytes_remaining < bsize) {
+			//Partial block: go through the bounce buffer
+			STATS_ADD(bounces, 1);
+			size_t amt = bsize - start_offset;
+			if (amt > bytes_remaining) {
+				amt = bytes_remaining;
+			}
+
+			//A write only needs to read the block if some of what it
+			//leaves out belongs to the file
+			if (!write || start_offset != 0 || file_offset + count < filesize) {
+				if (write) {
+					STATS_ADD(rmw, 1);
+				}
+				if (disk_read(fs->disk, disk_block, bounce_buf)) {
+					break;
+				}
+			} else {
+				memset(bounce_buf, 0, bsize);
+			}
+
+			if (write) {
+				block_iov_copy(0, iov, buf_index, bounce_buf + start_offset, amt);
+
+				if (disk_write(fs->disk, disk_block, bounce_buf)) {
+					break;
+				}
+			} else {
+				block_iov_copy(1, iov, buf_index, bounce_buf + start_offset, amt);
+			}
+
+			buf_index += amt;
+			curblock++;
+		} else {
+			//Whole blocks: move each physically contiguous run of the
+			//chain straight from or to the caller's buffer in one transfer
+			size_t run = bmap_run(map, curblock, bytes_remaining / bsize);
+			int cnt = block_iov_slice(iov, buf_index, run * bsize, sub);
+			int ret = -1;
+
+			if (req != NULL) {
+				pthread_mutex_lock(&fs->aio_lock);
+				ret = write ? disk_writev_async(fs->disk, disk_block, sub, cnt, req)
+					    : disk_readv_async(fs->disk, disk_block, sub, cnt, req);
+				if (ret == 0) {
+					//completed in fs_aio_poll()
+					req->pending++;
+				}
+				pthread_mutex_unlock(&fs->aio_lock);
+			}
+
+			if (ret == 0) {
+				//already submitted
+			} else if (write) {
+				ret = disk_writev(fs->disk, disk_block, sub, cnt);
+			} else {
+				ret = disk_readv(fs->disk, disk_block, sub, cnt);
+			}
+
+			if (ret) {
+				break;
+			}
+
+			buf_index += run * bsize;
+			curblock += run;
+		}
+	}
+
+	free(bounce_buf);
+	if (sub != local) {
+		free(sub);
+	}
+	return buf_index < count ? -1 : 0;
+}
+
+//add up the lengths of the iovcnt buffers described by iov into count.
+//returns -1 if the list is invalid or if the total doesn't fit in an int
+static int iov_total(const struct iovec *iov, int iovcnt, size_t *count)
+{
+	if (iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+		return -1;
+	}
+
+	*count = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > INT_MAX - *count) {
+			return -1;
+		}
+		*count += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+//record that the file open as fd now extends up to end, if it's bigger.
+//The root directory is only written right away for write-through files,
+//otherwise it waits for fs_close(), fs_fsync(), fs_sync() or fs_umount()
+static int file_grow(fs_t *fs, int fd, size_t end)
+{
+	int fsrd = fs->filedes[fd].fd_rd;
+
+	pthread_mutex_lock(&fs->rd_lock);
+	int grew = fs->RD[fsrd].fSize < end;
+	if (grew) {
+		fs->RD[fsrd].fSize = end;
+		fs->rd_dirty = 1;
+	}
+	pthread_mutex_unlock(&fs->rd_lock);
+
+	if (grew && fs->filedes[fd].fd_sync && update_RD(fs)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+//create an asynchronous request on fd. It holds a reference until the
+//caller is done submitting its transfers. returns NULL if the engine
+//isn't set up
+static struct Aio_Req * aio_req_new(fs_t *fs, int fd, void *user)
+{
+	struct Aio_Req * req = calloc(1, sizeof(struct Aio_Req));
+
+	if (req == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&fs->aio_lock);
+	if (!fs->aio.active) {
+		pthread_mutex_unlock(&fs->aio_lock);
+		free(req);
+		return NULL;
+	}
+
+	req->user = user;
+	req->fd = fd;
+	req->pending = 1;
+	fs->filedes[fd].fd_aio++;
+	fs->aio.inflight++;
+	pthread_mutex_unlock(&fs->aio_lock);
+
+	return req;
+}
+
+//drop a reference to req. Once its last transfer completed, queue it for
+//fs_aio_poll(), which also grows the file for a write.
+//The caller holds aio_lock
+static void aio_req_put(fs_t *fs, struct Aio_Req * req)
+{
+	if (--req->pending > 0) {
+		return;
+	}
+
+	req->next = NULL;
+	if (fs->aio.done_tail != NULL) {
+		fs->aio.done_tail->next = req;
+	} else {
+		fs->aio.done_head = req;
+	}
+	fs->aio.done_tail = req;
+}
+
+//free the context fs and everything it holds, closing its disk if it's
+//still open. Used when unmounting, and when mounting fails part way
+static void fs_free(fs_t *fs)
+{
+	flusher_stop(fs);
+
+	if (fs->disk != NULL) {
+		disk_close(fs->disk);
+	}
+
+	free(fs->SB);
+	free(fs->RD);
+	if (fs->fat != NULL) {
+		free(fs->fat->f_table);
+	}
+	free(fs->fat_dirty);
+	free(fs->fat);
+	if (fs->filedes != NULL) {
+		for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+			pthread_mutex_destroy(&fs->filedes[i].fd_lock);
+		}
+	}
+	free(fs->filedes);
+	if (fs->bmap != NULL) {
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			pthread_rwlock_destroy(&fs->bmap[i].lock);
+		}
+	}
+	free(fs->bmap);
+	free(fs->fmap.words);
+	free(fs->fmap.summary);
+	pthread_mutex_destroy(&fs->ns_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_mutex_destroy(&fs->rd_lock);
+	pthread_mutex_destroy(&fs->aio_lock);
+	pthread_cond_destroy(&fs->aio.reap_cond);
+	pthread_mutex_destroy(&fs->flush_lock);
+	free(fs);
+}
+
+//lock the file at RD index fsrd, shared to read it or exclusively (write)
+//to change its blocks or its RD entry
+static void file_lock(fs_t *fs, int fsrd, int write)
+{
+	if (write) {
+		pthread_rwlock_wrlock(&fs->bmap[fsrd].lock);
+	} else {
+		pthread_rwlock_rdlock(&fs->bmap[fsrd].lock);
+	}
+}
+
+static void file_unlock(fs_t *fs, int fsrd)
+{
+	pthread_rwlock_unlock(&fs->bmap[fsrd].lock);
+}
+
+//background flusher: every half expiry it writes the metadata changes
+//and the data dirty for longer than the expiry. When writers take the cache
+//over the background threshold, it writes the oldest data until it's under
+static void * flusher_main(void *arg)
+{
+	fs_t *fs = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&fs->flush_lock);
+	while (!fs->flush_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += fs->flush_expire / 2000;
+		ts.tv_nsec += (fs->flush_expire / 2 % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		int kicked = pthread_cond_timedwait(&fs->flush_cond, &fs->flush_lock, &ts) == 0;
+		if (fs->flush_stop) {
+			break;
+		}
+
+		unsigned int expire = kicked ? UINT_MAX : fs->flush_expire;
+		size_t background = fs->flush_background;
+		pthread_mutex_unlock(&fs->flush_lock);
+
+		//metadata goes to the cache like data does, and is written
+		//back with it once it expires. Failures leave the blocks
+		//dirty for the next pass, or for fs_sync()
+		if (!kicked) {
+			update_FAT(fs);
+			update_RD(fs);
+		}
+		disk_writeback(fs->disk, expire, background);
+
+		pthread_mutex_lock(&fs->flush_lock);
+	}
+	pthread_mutex_unlock(&fs->flush_lock);
+
+	return NULL;
+}
+
+static int flusher_start(fs_t *fs)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&fs->flush_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (flusher_tune(fs, FLUSH_EXPIRE_MS, FLUSH_BACKGROUND_RATIO, FLUSH_DIRTY_RATIO)) {
+		pthread_cond_destroy(&fs->flush_cond);
+		return -1;
+	}
+
+	fs->flush_stop = 0;
+	if (pthread_create(&fs->flusher, NULL, flusher_main, fs)) {
+		disk_dirty_limit(fs->disk, 0);
+		pthread_cond_destroy(&fs->flush_cond);
+		return -1;
+	}
+	fs->flush_running = 1;
+
+	return 0;
+}
+
+static void flusher_stop(fs_t *fs)
+{
+	if (!fs->flush_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&fs->flush_lock);
+	fs->flush_stop = 1;
+	pthread_cond_signal(&fs->flush_cond);
+	pthread_mutex_unlock(&fs->flush_lock);
+
+	pthread_join(fs->flusher, NULL);
+	pthread_cond_destroy(&fs->flush_cond);
+	fs->flush_running = 0;
+}
+
+//wake the flusher up if the cache went over the background threshold
+static void flusher_kick(fs_t *fs)
+{
+	struct block_cache_stats stats;
+
+	if (!fs->flush_running || disk_cache_stats(fs->disk, &stats)) {
+		return;
+	}
+
+	pthread_mutex_lock(&fs->flush_lock);
+	if (stats.dirty > fs->flush_background) {
+		pthread_cond_signal(&fs->flush_cond);
+	}
+	pthread_mutex_unlock(&fs->flush_lock);
+}
+
+//set the flusher's thresholds, the ratios being percentages of the cache
+static int flusher_tune(fs_t *fs, unsigned int expire_ms,
+			unsigned int background_ratio, unsigned int dirty_ratio)
+{
+	struct block_cache_stats stats;
+
+	if (expire_ms == 0 || background_ratio == 0 ||
+	    background_ratio > dirty_ratio || dirty_ratio > 100) {
+		return -1;
+	}
+
+	if (disk_cache_stats(fs->disk, &stats)) {
+		return -1;
+	}
+
+	//a mapped disk has no cache, the kernel writes its data back
+	size_t limit = stats.size * dirty_ratio / 100;
+	if (stats.size > 0 && limit == 0) {
+		limit = 1;
+	}
+	if (disk_dirty_limit(fs->disk, limit)) {
+		return -1;
 	}
 
-	free(bounce_buf);
+	pthread_mutex_lock(&fs->flush_lock);
+	fs->flush_expire = expire_ms;
+	fs->flush_background = stats.size * background_ratio / 100;
+	pthread_cond_signal(&fs->flush_cond);
+	pthread_mutex_unlock(&fs->flush_lock);
 
-	return buf_index;
+	return 0;
 }
 
-//using generic variables like rootdir. Will refactor when other phases are finalized
-//ceilingdiv(a,b) is a symbolic function, defined at the top
-//it is simply CEILING(a/b), with integers a and b
-//May bug out on testing due to mixing 0-indexed values and 1-indexed values
-int fs_read(int fd, void *buf, size_t count)
+//phase 1-2 helper functions
+//this function reads the superblock of either version and checks its
+//geometry. The disk can only be opened once its block size is known, so the
+//superblock is read straight from the file: its fields are all in the first
+//BLOCK_SIZE_MIN bytes, whatever the block size
+static int read_in_SB(fs_t *fs, const char *diskname)
 {
-	//fd is out of bounds
-	if (fd > FS_OPEN_MAX_COUNT) {
+	//compare SB signature to this in order to validate it
+	char signature[8] = {'E','C','S','1','5','0','F','S'};
+	union {
+		struct sBlock_V1 v1;
+		struct sBlock_V2 v2;
+	} sb;
+
+	memset(&sb, 0, sizeof(sb));
+	int fd = open(diskname, O_RDONLY);
+	if (fd < 0) {
 		return -1;
 	}
-
-	//fd is not currently open
-	if (fd_exists(fd)) {
+	ssize_t len = pread(fd, &sb, sizeof(sb), 0);
+	close(fd);
+	if (len < BLOCK_SIZE_MIN) {
 		return -1;
 	}
 
-	//Used for first and last block
-	void *bounce_buf = malloc(BLOCK_SIZE);
-
-	//Data about the file
-	int file_offset = filedes[fd].fd_offset;
-	int block_offset = file_offset % BLOCK_SIZE;
-	int fsrd = return_rd(filedes[fd].fd_filename);
-	int filesize = RD[fsrd].fSize;
-
-	//Variables manipulated to read the correct portion
-	int read_amt = 0;
-	int buf_index = 0;
-	int bytes_remaining = count;
-	uint16_t start_offset = 0;
-	uint16_t end_offset = 0;
-
-	//which index of block from FAT to read from: ceiling(offset/BLOCK_SIZE)
-	//Division of integers returns floor(a/b)
-	int target_blocknum = file_offset/BLOCK_SIZE;
-
-	//the first block in the chain
-	uint16_t firstblock = RD[fsrd].f_index;
-	uint16_t curblock = firstblock;
-
-	//Cycles through the fat and finds the index target_blocknum in fd
-	for (int i = 0; i < target_blocknum; i++) {
-		curblock = fat->f_table[curblock];
+	//validate that SB has correct signature 
+	//use strncmp becasue it's not NULL terminated
+	if (strncmp(signature, sb.v1.Sig,8)!=0) {
+		return -1;
 	}
 
-	do {
-		if (curblock == firstblock) {
-			start_offset = block_offset;
-		} else {
-			start_offset = 0;
-		}
-
-		//if curblock is the last of the chain
-		if (fat->f_table[curblock] == FAT_EOC || bytes_remaining < BLOCK_SIZE) {
-			//If desired read is longer than the filesize
-			if (file_offset + count - 1 > filesize) {
-				//Read to end of file
-				end_offset = (filesize % BLOCK_SIZE) - 1;
-			} else {
-				//else read as many bytes as count
-				end_offset = count - buf_index - 1;
-			}
-		} else {
-			end_offset = BLOCK_SIZE - 1;
-		}
-
-		read_amt = end_offset - start_offset + 1;
-
-		//If reading the whole block, don't need to use a bounce buffer
-		if (read_amt == BLOCK_SIZE) {
-			if (block_read(curblock + SB->d_block_start, buf + buf_index)) {
-				return -1;
-			}
-		} else {
-			if (block_read(curblock + SB->d_block_start, bounce_buf)) {
-				return -1;
-			}
-
-			memcpy(buf + buf_index, bounce_buf + start_offset, read_amt);
+	if (sb.v1.tNumBlocks!=0) {
+		fs->SB->version = FS_FORMAT_V1;
+		fs->SB->block_size = BLOCK_SIZE;
+		fs->SB->tNumBlocks = sb.v1.tNumBlocks;
+		fs->SB->rdb_Index = sb.v1.rdb_Index;
+		fs->SB->d_block_start = sb.v1.d_block_start;
+		fs->SB->nDataBlocks = sb.v1.nDataBlocks;
+		fs->SB->nFAT_Blocks = sb.v1.nFAT_Blocks;
+	} else {
+		//refuse the versions this code doesn't know the layout of, and
+		//block sizes the disk can't use
+		uint32_t bsize = sb.v2.block_size;
+		if (sb.v2.version!=FS_FORMAT_V2 || bsize < BLOCK_SIZE_MIN || bsize > BLOCK_SIZE_MAX
+		    || (bsize & (bsize - 1))!=0) {
+			return -1;
 		}
+		fs->SB->version = FS_FORMAT_V2;
+		fs->SB->block_size = bsize;
+		fs->SB->tNumBlocks = sb.v2.tNumBlocks;
+		fs->SB->rdb_Index = sb.v2.rdb_Index;
+		fs->SB->d_block_start = sb.v2.d_block_start;
+		fs->SB->nDataBlocks = sb.v2.nDataBlocks;
+		fs->SB->nFAT_Blocks = sb.v2.nFAT_Blocks;
+	}
+
+	fs->SB->nRD_Blocks = ceilingdiv(FS_FILE_MAX_COUNT * sizeof(struct Root_Dir), fs->SB->block_size);
+
+	//the root directory and the data blocks, at least the one whose FAT
+	//entry is reserved, must be on the disk
+	if (fs->SB->nDataBlocks == 0 || fs->SB->rdb_Index > fs->SB->tNumBlocks - fs->SB->nRD_Blocks
+	    || fs->SB->d_block_start > fs->SB->tNumBlocks
+	    || fs->SB->nDataBlocks > fs->SB->tNumBlocks - fs->SB->d_block_start) {
+		return -1;
+	}
 
-		bytes_remaining -= read_amt;
-		buf_index += read_amt;
-
-		curblock = fat->f_table[curblock];
-
-	} while (curblock != FAT_EOC && bytes_remaining > 0);
-
-	//need to use buf_index because count could exceed the size of the file
-	filedes[fd].fd_offset = filedes[fd].fd_offset + buf_index;
-
-	free(bounce_buf);
-
-	return buf_index;
+	return 0;
 }
 
-
-//phase 1-2 helper functions
-static int read_in_RD()
+static int read_in_RD(fs_t *fs)
 {
-	//read root directory block from root dir block index
-	int ret = block_read(SB->rdb_Index,RD);
-	return ret;
+	//read root directory blocks from root dir block index
+	if (fs->SB->version!=FS_FORMAT_V1) {
+		struct iovec iov = {
+			.iov_base = fs->RD,
+			.iov_len = (size_t)fs->SB->nRD_Blocks * fs->SB->block_size
+		};
+		return disk_readv(fs->disk, fs->SB->rdb_Index, &iov, 1);
+	}
+
+	//version 1 entries are narrower, widen them
+	struct Root_Dir_V1 rd[FS_FILE_MAX_COUNT];
+	if (disk_read(fs->disk, fs->SB->rdb_Index, rd)!=0) {
+		return -1;
+	}
+	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
+		memcpy(fs->RD[i].fname, rd[i].fname, FS_FILENAME_LEN);
+		fs->RD[i].fSize = rd[i].fSize;
+		fs->RD[i].f_index = rd[i].f_index == FAT_EOC_V1 ? FAT_EOC : rd[i].f_index;
+	}
+
+	return 0;
 }
 
-static int update_RD()
+static int update_RD(fs_t *fs)
 {
-	//write root directory block to root dir block index
-	int ret = block_write(SB->rdb_Index,RD);
+	int ret = 0;
+
+	//nothing changed since the last write
+	pthread_mutex_lock(&fs->rd_lock);
+	if (fs->rd_dirty) {
+		//write root directory blocks to root dir block index
+		if (fs->SB->version!=FS_FORMAT_V1) {
+			struct iovec iov = {
+				.iov_base = fs->RD,
+				.iov_len = (size_t)fs->SB->nRD_Blocks * fs->SB->block_size
+			};
+			ret = disk_writev(fs->disk, fs->SB->rdb_Index, &iov, 1);
+		} else {
+			//narrow the entries back to version 1, whose volumes are
+			//too small for a file size not to fit in 32 bits
+			struct Root_Dir_V1 rd[FS_FILE_MAX_COUNT];
+			memset(rd, 0, sizeof(rd));
+			for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
+				memcpy(rd[i].fname, fs->RD[i].fname, FS_FILENAME_LEN);
+				rd[i].fSize = fs->RD[i].fSize;
+				rd[i].f_index = fs->RD[i].f_index == FAT_EOC ? FAT_EOC_V1 : fs->RD[i].f_index;
+			}
+			ret = disk_write(fs->disk, fs->SB->rdb_Index, rd);
+		}
+		if (ret == 0) {
+			fs->rd_dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&fs->rd_lock);
 	return ret;
 }
 //this function reads the FAT table from the disk
-static int read_in_FAT()
+static int read_in_FAT(fs_t *fs)
 {
-	
-	int size=0, y=0;
-
-	//retrieve an array that is atleast as large as the FAT table but
-	//is also a multiple of BLOCK_SIZE
-	char *new_array =resize_buffer((char *)fat->f_table,SB->nDataBlocks*sizeof(uint16_t),&size);
-	int retVals[SB->rdb_Index-1];
-
-	//copy FAT table in from disk to new_array
-	for (int i =1; i<SB->rdb_Index; i++) {
-		y=i-1;
-		retVals[i]=block_read(i,new_array+(y*BLOCK_SIZE));
-		if (retVals[i]==-1) {
-			free(new_array);
-			return -1;
-		}
+	//the FAT blocks directly follow the superblock, read them all
+	//straight into f_table
+	struct iovec iov = {
+		.iov_base = fs->fat->f_table,
+		.iov_len = (size_t)fs->SB->nFAT_Blocks * fs->SB->block_size
+	};
+
+	if (disk_readv(fs->disk, 1, &iov, 1)) {
+		return -1;
 	}
 
-	//copy contents from new_array to f_table
-	uint16_t * upFAT=(uint16_t*)new_array;
-	for (int i =0; i<SB->nDataBlocks; i++) {
-		fat->f_table[i]=upFAT[i];
-	}
-	
-	free(new_array);
 	return 0;
 	
 }
 
-//this function writes the contents of the fat table to disk
-static int update_FAT()
+//this function writes the FAT blocks which changed since they were last
+//written to disk
+static int update_FAT(fs_t *fs)
 {
-	int size=0, y=0;
+	size_t i = 0;
 
-	//new_array conatains all contents of fat->f_table and is
-	//an ammount of bytes that is a multiple of BLOCK_SIZE
-	char *new_array =resize_buffer((char*)fat->f_table,SB->nDataBlocks*sizeof(uint16_t),&size);
-	int retVals[SB->rdb_Index-1];
-	
-	//write new_array into disk where FAT table is located
-	for (int i=1; i<SB->rdb_Index; i++) {
-		y=i-1;
-		retVals[i]=block_write(i,new_array + (y*BLOCK_SIZE));
-		if (retVals[i]==-1) {
-			free(new_array);
+	pthread_mutex_lock(&fs->alloc_lock);
+	while (i < fs->SB->nFAT_Blocks) {
+		if (!fs->fat_dirty[i]) {
+			i++;
+			continue;
+		}
+
+		//write consecutive dirty blocks with a single transfer
+		size_t run = 1;
+		while (i + run < fs->SB->nFAT_Blocks && fs->fat_dirty[i + run]) {
+			run++;
+		}
+
+		struct iovec iov = {
+			.iov_base = (char *)fs->fat->f_table + i * fs->SB->block_size,
+			.iov_len = run * fs->SB->block_size
+		};
+		if (disk_writev(fs->disk, 1 + i, &iov, 1)) {
+			pthread_mutex_unlock(&fs->alloc_lock);
 			return -1;
 		}
+
+		memset(fs->fat_dirty + i, 0, run);
+		STATS_ADD(fat_flushed, run);
+		i += run;
 	}
-	
-	free(new_array);
+	pthread_mutex_unlock(&fs->alloc_lock);
+
 	return 0;
 	
 }
 
-//this fruntion returns an array that is atleast as large as
-//buffer, but is also a multiple of BLOCK_SIZE, new_size will
-//store the size of the array this function returns
-static char * resize_buffer(char * buffer, int old_size, int * new_size)
+//read a FAT entry, the end of a chain is FAT_EOC whatever the version
+static uint32_t fat_get(fs_t *fs, uint32_t index)
 {
-	char * new_buffer;
-
-	//if buffer is already a multiple of BLOCK_SIZE
-	if ((old_size%BLOCK_SIZE)==0) {
-		new_buffer = calloc(old_size, sizeof(char));
-		for (int i=0; i < old_size; i++) {
-		 new_buffer[i]=buffer[i];
-		}
-		*new_size=old_size;
-		return new_buffer;
-	}
-	else{
-		//duplicating old buffer into new buffer that is 
-		//a multiple of BLOCK_SIZE
-		int blocks = old_size/BLOCK_SIZE;
-		blocks=blocks+1;
-		int num_bytes = blocks*BLOCK_SIZE;
-		*new_size=num_bytes;
-		new_buffer = calloc(num_bytes, sizeof(char));
-		//iterate up to size of original buffer size, old_size
-		for (int i=0; i<old_size; i++) {
-			new_buffer[i]=buffer[i];
-		}
+	if (fs->fat->entry_size == sizeof(uint16_t)) {
+		uint16_t entry = ((uint16_t *)fs->fat->f_table)[index];
+		return entry == FAT_EOC_V1 ? FAT_EOC : entry;
 	}
 
-	return new_buffer;
-	
+	return ((uint32_t *)fs->fat->f_table)[index];
+}
+
+//set a FAT entry and remember that its FAT block must be written
+static void fat_set(fs_t *fs, uint32_t index, uint32_t value)
+{
+	if (fs->fat->entry_size == sizeof(uint16_t)) {
+		((uint16_t *)fs->fat->f_table)[index] = value == FAT_EOC ? FAT_EOC_V1 : value;
+	} else {
+		((uint32_t *)fs->fat->f_table)[index] = value;
+	}
+	fs->fat_dirty[(size_t)index * fs->fat->entry_size / fs->SB->block_size] = 1;
 }
 
 //find the RD entry named fname and rename it
 //'\0'
-static int delete_root(const char * fname)
+static int delete_root(fs_t *fs, const char * fname)
 {
-	//iterate through the root directory
-	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
-		//check each entry until one matches
-		if (strcmp(RD[i].fname,fname)==0) {
-			RD[i].fname[0]='\0';
-			return 0;
-		}
+	int i = return_rd(fs, fname);
+
+	if (i == RD_NONE) {
+		return -1;
 	}
-	return -1;
+
+	rd_index_remove(fs, i);
+	fs->RD[i].fname[0]='\0';
+	return 0;
 }
 
 //take in a filename and determine if it exists in
 //the root directory
-static int file_exist(const char * fname)
+static int file_exist(fs_t *fs, const char * fname)
 {
-	//iterate through the root directory
-	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
-		//check each entry until one matches
-		if ((strcmp(RD[i].fname,fname)==0)) {
-			return 0;
+	if (return_rd(fs, fname) == RD_NONE) {
+		return -1;
+	}
+
+	return 0;
+}
+
+//check that a filename is not empty, and NULL terminated within
+//FS_FILENAME_LEN characters
+static int filename_valid(const char *filename)
+{
+	if (filename == NULL) {
+		return -1;
+	}
+
+	if (filename[0] == '\0') {
+		return -1;
+	}
+
+	int i = 0;
+	while (filename[i] != '\0') {
+		if ((i+1==FS_FILENAME_LEN)&&(filename[i] != '\0')) {
+			return -1;
 		}
+		i++;
 	}
 
-	return -1;
+	return 0;
 }
 
 //delete FAT entries of a file, starting at index fir_block
-static int delete_file(int fir_block)
+static int delete_file(fs_t *fs, uint32_t fir_block)
 {
-	int temp =0; 
+	uint32_t temp =0; 
 	
 	//iterate through the fat table 
-	for (int i=0; i<SB->nDataBlocks; i++) {
+	for (uint32_t i=0; i<fs->SB->nDataBlocks; i++) {
 		//if found the last entry, set it to 0
 		//and return
-		if (fat->f_table[fir_block]==FAT_EOC) {
-			fat->f_table[fir_block]=0;
+		if (fat_get(fs, fir_block)==FAT_EOC) {
+			fat_set(fs, fir_block, 0);
+			fmap_release(fs, fir_block);
 			return 0;
 		}
 
-		temp = fat->f_table[fir_block];
-		fat->f_table[fir_block]=0;
+		temp = fat_get(fs, fir_block);
+		fat_set(fs, fir_block, 0);
+		fmap_release(fs, fir_block);
 		
 		//set the next index to what is in the
 		//entry of the current fat block index
@@ -845,15 +3014,16 @@ static int delete_file(int fir_block)
 }
 
 //create a root directory entry named file_n
-static struct Root_Dir * create_root(const char *file_n)
+static struct Root_Dir * create_root(fs_t *fs, const char *file_n)
 {
 	//iterate through the root directory
 	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
 		//when find an empty entry occupy it with
 		//file_n
-		  if (RD[i].fname[0]=='\0') {
-			strcpy(RD[i].fname, file_n);
-			return RD+i;
+		  if (fs->RD[i].fname[0]=='\0') {
+			strcpy(fs->RD[i].fname, file_n);
+			rd_index_add(fs, i);
+			return fs->RD+i;
 		  }
 	}
 
@@ -861,46 +3031,22 @@ static struct Root_Dir * create_root(const char *file_n)
 	return NULL;
 }
 
-//iterate through fat table, return the next empty index
-static int next_block()
-{
-	
-	for (int i =1; i<SB->nDataBlocks; i++) {
-		if (fat->f_table[i]==0) {
-			return i;
-		}
-	}
-
-	//FAT table is full
-	return -1;
-}
-
 //count the number of empty indices in fat table
-static int free_FAT_blocks()
+static int free_FAT_blocks(fs_t *fs)
 {
-	int fb_count=0;
-
-	//iterate through FAT and increment fb_count for
-	//every empty index
-	for (int i =0;i<SB->nDataBlocks;i++) {
-		if (fat->f_table[i]==0) {
-			fb_count++;
-		}
-	}
-
-	//return number of empty indices
-	return fb_count;
+	//kept up to date by the free map
+	return fs->fmap.nfree;
 }
 
 //count the number of free root drectory blocks
-static int free_RD_blocks()
+static int free_RD_blocks(fs_t *fs)
 {
 	int rdb_count=0;
 
 	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
 		//iterate through RD and increment rdb_count for
 		//every empty index
-		if (RD[i].fname[0]=='\0') {
+		if (fs->RD[i].fname[0]=='\0') {
 		  rdb_count++;
 		}
 	}
@@ -911,34 +3057,39 @@ static int free_RD_blocks()
 
 //phase 3 helper functions
 
-//initialize file descriptor fd and name it 
-//filename
-static int fs_fd_init(int fd, const char *filename)
+//initialize file descriptor fd and point it at 
+//the RD entry fsrd
+static int fs_fd_init(fs_t *fs, int fd, int fsrd)
 {
-	filedes[fd].fd_offset = 0;
-	strcpy(filedes[fd].fd_filename, filename);
+	fs->filedes[fd].fd_offset = 0;
+	fs->filedes[fd].fd_rd = fsrd;
+	fs->filedes[fd].fd_sync = 0;
+	fs->filedes[fd].fd_aio = 0;
+	fs->filedes[fd].fd_ra_next = 0;
+	fs->filedes[fd].fd_ra_end = 0;
+	fs->filedes[fd].fd_ra_size = 0;
 
 	return 0;
 	
 }
 
 //return index of file in the root directory table
-static int return_rd(char * fd_name)
+static int return_rd(fs_t *fs, const char * fd_name)
 {
-	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
-		//compare input string to filenames in root directory
-		if ((strcmp(RD[i].fname,fd_name)==0)) {
-		  return i;
+	//only the entries in fd_name's bucket can match
+	for (int i = fs->rd_bucket[rd_hash(fd_name)]; i != RD_NONE; i = fs->rd_next[i]) {
+		if (strncmp(fs->RD[i].fname, fd_name, FS_FILENAME_LEN) == 0) {
+			return i;
 		}
 	}
 
-	return -1;
+	return RD_NONE;
 }
 
 //check if file descriptor exists
-static int fd_exists(int fd)
+static int fd_exists(fs_t *fs, int fd)
 {
-	if (filedes[fd].fd_filename[0]=='\0') {
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fs->filedes[fd].fd_rd == RD_NONE) {
 		return -1;
 	}
 	
@@ -946,51 +3097,318 @@ static int fd_exists(int fd)
 	
 }
 //search RD for fd_name to decide if it exists
-static int file_exists(const char * fd_name)
+static int file_exists(fs_t *fs, const char * fd_name)
 {
-	for (int i=0; i<FS_FILE_MAX_COUNT; i++) {
-		//compare input string to filenames in root directory
-		if ((strcmp(RD[i].fname,fd_name)==0)) {
-		  return 0;
-		}
-	}
-
-	return -1;
+	return file_exist(fs, fd_name);
 }
 
 //returns the number of blocks added, which is as many as possible.
-static uint32_t file_extend(int fd, uint16_t blockcount)
+//blocks are taken in runs, continuing right after the file's last block
+//whenever possible so that the file stays contiguous on disk
+static uint32_t file_extend(fs_t *fs, int fd, size_t blockcount)
 {
-	//next available data block in FAT
-	int alloc_block;
-	uint16_t curblock = 0;
 	uint32_t blocks_added = 0;
-	//fd's root directory index
-	int fsrd = return_rd(filedes[fd].fd_filename);
+	//fd's root directory index and block map
+	int fsrd = fs->filedes[fd].fd_rd;
+	struct Block_Map * map = &fs->bmap[fsrd];
 
-	//find directory entry for fd
-	curblock = RD[fsrd].f_index;
-	while (fat->f_table[curblock] != FAT_EOC) {
-		curblock = fat->f_table[curblock];
-	}
-	//curblock now equals the last block of fd's chain
-
-	for (int i = 0; i < blockcount; i++) {
-		alloc_block = next_block();
+	while (blocks_added < blockcount) {
+		uint32_t start;
+		//the block right after the last block of fd's chain
+		size_t goal = map->count ? map->blocks[map->count - 1] + 1 : 0;
+		size_t run = alloc_run(fs, goal, blockcount - blocks_added, &start);
 
 		//no more space in disk
-		if (alloc_block == -1) {
+		if (run == 0) {
 			break;
 		}
 
-		//incorporate the new block to the fd's chain
-		fat->f_table[alloc_block] = FAT_EOC;
-		fat->f_table[curblock] = (uint16_t) alloc_block;
-		curblock = (uint16_t) alloc_block;
+		//incorporate the new blocks to the fd's chain
+		if (chain_add_run(fs, fsrd, start, run)) {
+			for (size_t i = 0; i < run; i++) {
+				fmap_release(fs, start + i);
+			}
+			break;
+		}
 
 		//for updating the file's entry in root dir
-		blocks_added++;
+		blocks_added += run;
 	}
 	
 	return blocks_added;
 }
+
+//phase 4 helper functions
+
+//return the block map of the file at RD index fsrd, building it from the
+//FAT if no file descriptor is using it yet
+static struct Block_Map * bmap_get(fs_t *fs, int fsrd)
+{
+	struct Block_Map * map = &fs->bmap[fsrd];
+
+	if (map->refs == 0) {
+		map->count = 0;
+		for (uint32_t cur = fs->RD[fsrd].f_index; cur != FAT_EOC; cur = fat_get(fs, cur)) {
+			if (bmap_append(map, cur)) {
+				return NULL;
+			}
+		}
+	}
+
+	map->refs++;
+	return map;
+}
+
+//drop a reference to the block map of the file at RD index fsrd, and free
+//it once the file is no longer open
+static void bmap_put(fs_t *fs, int fsrd)
+{
+	struct Block_Map * map = &fs->bmap[fsrd];
+
+	if (--map->refs == 0) {
+		free(map->blocks);
+		map->blocks = NULL;
+		map->count = 0;
+		map->cap = 0;
+	}
+}
+
+//make sure the map can hold count more blocks without failing
+static int bmap_reserve(struct Block_Map * map, size_t count)
+{
+	if (map->count + count > map->cap) {
+		size_t new_cap = map->cap ? map->cap : 16;
+		while (new_cap < map->count + count) {
+			new_cap *= 2;
+		}
+
+		uint32_t * blocks = realloc(map->blocks, new_cap * sizeof(uint32_t));
+		if (blocks == NULL) {
+			return -1;
+		}
+		map->blocks = blocks;
+		map->cap = new_cap;
+	}
+
+	return 0;
+}
+
+//add block to the end of the map
+static int bmap_append(struct Block_Map * map, uint32_t block)
+{
+	if (map->count == map->cap) {
+		size_t new_cap = map->cap ? 2 * map->cap : 16;
+		uint32_t * blocks = realloc(map->blocks, new_cap * sizeof(uint32_t));
+
+		if (blocks == NULL) {
+			return -1;
+		}
+		map->blocks = blocks;
+		map->cap = new_cap;
+	}
+
+	map->blocks[map->count++] = block;
+	return 0;
+}
+
+//count how many blocks of the map, starting at index idx, directly follow
+//each other on disk (up to max)
+static size_t bmap_run(struct Block_Map * map, size_t idx, size_t max)
+{
+	size_t run = 1;
+
+	while (run < max && map->blocks[idx + run] == map->blocks[idx] + run) {
+		run++;
+	}
+
+	return run;
+}
+
+//build the free map from the FAT. Index 0 is never free
+static int fmap_build(fs_t *fs)
+{
+	fs->fmap.nwords = ceilingdiv(fs->SB->nDataBlocks, 64);
+	fs->fmap.words = calloc(fs->fmap.nwords, sizeof(uint64_t));
+	fs->fmap.summary = calloc(ceilingdiv(fs->fmap.nwords, 64), sizeof(uint64_t));
+	fs->fmap.nfree = 0;
+
+	if (fs->fmap.words == NULL || fs->fmap.summary == NULL) {
+		free(fs->fmap.words);
+		free(fs->fmap.summary);
+		return -1;
+	}
+
+	for (uint32_t i = 1; i < fs->SB->nDataBlocks; i++) {
+		if (fat_get(fs, i) == 0) {
+			fmap_release(fs, i);
+		}
+	}
+
+	return 0;
+}
+
+//mark block as used in the free map
+static void fmap_take(fs_t *fs, uint32_t block)
+{
+	size_t w = block / 64;
+
+	fs->fmap.words[w] &= ~(1ULL << (block % 64));
+	if (fs->fmap.words[w] == 0) {
+		fs->fmap.summary[w / 64] &= ~(1ULL << (w % 64));
+	}
+	fs->fmap.nfree--;
+}
+
+//mark block as free in the free map
+static void fmap_release(fs_t *fs, uint32_t block)
+{
+	size_t w = block / 64;
+
+	fs->fmap.words[w] |= 1ULL << (block % 64);
+	fs->fmap.summary[w / 64] |= 1ULL << (w % 64);
+	fs->fmap.nfree++;
+}
+
+//FNV-1a hash of a filename, reduced to a bucket of the filename index
+static unsigned int rd_hash(const char * fname)
+{
+	uint32_t h = 2166136261u;
+
+	for (int i = 0; i < FS_FILENAME_LEN && fname[i] != '\0'; i++) {
+		h = (h ^ (unsigned char)fname[i]) * 16777619u;
+	}
+
+	return h & (RD_HASH_SIZE - 1);
+}
+
+//add the RD entry fsrd to the filename index
+static void rd_index_add(fs_t *fs, int fsrd)
+{
+	unsigned int b = rd_hash(fs->RD[fsrd].fname);
+
+	fs->rd_next[fsrd] = fs->rd_bucket[b];
+	fs->rd_bucket[b] = fsrd;
+}
+
+//remove the RD entry fsrd from the filename index
+static void rd_index_remove(fs_t *fs, int fsrd)
+{
+	int * link = &fs->rd_bucket[rd_hash(fs->RD[fsrd].fname)];
+
+	while (*link != fsrd) {
+		link = &fs->rd_next[*link];
+	}
+	*link = fs->rd_next[fsrd];
+}
+
+//check if block is a free data block
+static int fmap_is_free(fs_t *fs, size_t block)
+{
+	if (block == 0 || block >= fs->SB->nDataBlocks) {
+		return 0;
+	}
+
+	return (fs->fmap.words[block / 64] >> (block % 64)) & 1;
+}
+
+//find the free run that fits want blocks best: the shortest run at least
+//want blocks long or, if there is none, the longest run. start is set to
+//the first block of the run and its length is returned (0 if no block
+//is free)
+static size_t fmap_find_run(fs_t *fs, size_t want, uint32_t *start)
+{
+	size_t best_len = 0, best_start = 0;
+	size_t run_len = 0, run_start = 0;
+	size_t b = 1;
+
+	while (b <= fs->SB->nDataBlocks) {
+		uint64_t word = b < fs->SB->nDataBlocks ? fs->fmap.words[b / 64] : 0;
+		size_t step = 1;
+		int is_free = (word >> (b % 64)) & 1;
+
+		//skip whole words which are entirely used or entirely free
+		if (b % 64 == 0 && (word == 0 || word == ~0ULL)
+		    && b + 64 <= fs->SB->nDataBlocks) {
+			step = 64;
+		}
+
+		if (is_free) {
+			if (run_len == 0) {
+				run_start = b;
+			}
+			run_len += step;
+		} else if (run_len) {
+			//a run just ended, keep it if it fits better
+			if ((run_len >= want && (best_len < want || run_len < best_len))
+			    || (best_len < want && run_len > best_len)) {
+				best_len = run_len;
+				best_start = run_start;
+			}
+			run_len = 0;
+			//an exact fit can't be beaten
+			if (best_len == want) {
+				break;
+			}
+		}
+
+		b += step;
+	}
+
+	*start = best_start;
+	return best_len;
+}
+
+//take up to want free blocks in a single run, starting at goal if that
+//block is free and otherwise in the best fitting free run. start is set
+//to the first block taken and the number of blocks taken is returned
+static size_t alloc_run(fs_t *fs, size_t goal, size_t want, uint32_t *start)
+{
+	size_t len = 0;
+
+	if (fmap_is_free(fs, goal)) {
+		*start = goal;
+		while (len < want && fmap_is_free(fs, goal + len)) {
+			len++;
+		}
+	} else {
+		len = fmap_find_run(fs, want, start);
+		if (len > want) {
+			len = want;
+		}
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		fmap_take(fs, *start + i);
+	}
+
+	return len;
+}
+
+//link the count blocks starting at start to the end of the chain of the
+//file at RD index fsrd, and to its block map
+static int chain_add_run(fs_t *fs, int fsrd, uint32_t start, size_t count)
+{
+	struct Block_Map * map = &fs->bmap[fsrd];
+
+	if (bmap_reserve(map, count)) {
+		return -1;
+	}
+
+	if (map->count == 0) {
+		pthread_mutex_lock(&fs->rd_lock);
+		fs->RD[fsrd].f_index = start;
+		fs->rd_dirty = 1;
+		pthread_mutex_unlock(&fs->rd_lock);
+	} else {
+		fat_set(fs, map->blocks[map->count - 1], start);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t block = start + i;
+
+		fat_set(fs, block, (i + 1 < count) ? block + 1 : FAT_EOC);
+		map->blocks[map->count++] = block;
+	}
+
+	return 0;
+}
@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +13,180 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Access the virtual disk file through a memory mapping, see fs_mount_flags() */
+#define FS_MOUNT_MMAP 0x1
+
+/** Write dirty data back from a background thread, see fs_mount_flags() */
+#define FS_MOUNT_FLUSH 0x2
+
+/** Run asynchronous requests on a thread pool, see fs_aio_setup() */
+#define FS_AIO_THREADS 0x1
+
+/** Original ECS150FS format, 16-bit block numbers, see fs_format() */
+#define FS_FORMAT_V1 1
+
+/** Format with 32-bit block numbers and 64-bit file sizes, see fs_format() */
+#define FS_FORMAT_V2 2
+
+/**
+ * struct fs_aio_event - Completion of an asynchronous request
+ * @user: Cookie passed when submitting the request
+ * @result: Number of bytes transferred, or -1 on failure
+ */
+struct fs_aio_event {
+	void *user;
+	int result;
+};
+
+/**
+ * struct fs_view - Borrowed view of file data
+ * @iov: Segments of file data, in file order
+ * @iovcnt: Number of segments in @iov
+ * @len: Total length of the segments
+ * @blocks: Disk blocks pinned by the view (private)
+ * @nblocks: Number of blocks in @blocks (private)
+ */
+struct fs_view {
+	struct iovec *iov;
+	int iovcnt;
+	size_t len;
+	size_t *blocks;
+	size_t nblocks;
+};
+
+/**
+ * Operations accounted for by fs_stats(), one per public function. The block
+ * transfers of an operation are traced with label op + 1, see
+ * block_trace_start() in disk.h.
+ */
+enum fs_op {
+	FS_OP_MOUNT,
+	FS_OP_UMOUNT,
+	FS_OP_SYNC,
+	FS_OP_INFO,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_LS,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_FSYNC,
+	FS_OP_SET_WRITETHROUGH,
+	FS_OP_SET_WRITEBACK,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_WRITE,
+	FS_OP_READ,
+	FS_OP_READ_VIEW,
+	FS_OP_RELEASE_VIEW,
+	FS_OP_FALLOCATE,
+	FS_OP_AIO_SETUP,
+	FS_OP_AIO_TEARDOWN,
+	FS_OP_READ_ASYNC,
+	FS_OP_WRITE_ASYNC,
+	FS_OP_AIO_POLL,
+	FS_OP_CREATE_MANY,
+	FS_OP_DELETE_MANY,
+	FS_OP_WRITEV,
+	FS_OP_READV,
+	FS_OP_PREAD,
+	FS_OP_PWRITE,
+	FS_OP_STAT64,
+	FS_OP_COUNT
+};
+
+/** Number of latency buckets in struct fs_op_stats */
+#define FS_STATS_BUCKETS 32
+
+/**
+ * struct fs_op_stats - Counters of one operation
+ * @calls: Number of calls
+ * @errors: Calls that returned an error
+ * @bytes: Bytes transferred by reads and writes
+ * @p50_ns: Median latency in nanoseconds
+ * @p99_ns: 99th percentile latency in nanoseconds
+ * @max_ns: Highest latency in nanoseconds
+ * @hist: Calls by latency, entry i counting latencies below 2^i ns that are
+ *        not counted by entry i - 1. The last entry counts all the others.
+ */
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t max_ns;
+	uint64_t hist[FS_STATS_BUCKETS];
+};
+
+/**
+ * struct fs_stats - File system statistics
+ * @ops: Counters of each operation, indexed by enum fs_op
+ * @bounces: Partial blocks transferred through a bounce buffer
+ * @rmw: Partial block writes that had to read the block first
+ * @fat_flushed: FAT blocks written to disk
+ * @io: Block layer transfer counters, see block_io_stats()
+ */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+	uint64_t bounces;
+	uint64_t rmw;
+	uint64_t fat_flushed;
+	struct {
+		uint64_t reads;
+		uint64_t writes;
+		uint64_t read_calls;
+		uint64_t write_calls;
+		uint64_t cache_hits;
+		uint64_t cache_misses;
+	} io;
+};
+
+/*
+ * Each function below operates on the file system mounted with fs_mount(). Its
+ * _ctx counterpart, declared at the end of this file, takes the file system it
+ * operates on instead, as returned by fs_mount_ctx(). Several file systems can
+ * be mounted that way at the same time, from different virtual disk files,
+ * and they share no state. File descriptors are private to their file system.
+ *
+ * A file system can be used from several threads at once. Transfers on
+ * different files proceed in parallel, and reads of the same file share it;
+ * only writes to a file exclude each other. Mounting and unmounting must not
+ * race with other calls. Threads sharing a file descriptor also share its
+ * file offset: fs_read() and fs_write() through it update the offset safely,
+ * but are unordered, so concurrent reads may return the same bytes.
+ */
+typedef struct fs fs_t;
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks
+ * @block_size: Size of a block in bytes
+ * @version: On-disk format, %FS_FORMAT_V1 or %FS_FORMAT_V2
+ *
+ * Create the virtual disk file @diskname, replacing any file of that name,
+ * with an empty file system of @data_blocks data blocks. With %FS_FORMAT_V1,
+ * the layout is the original ECS150FS one, which block numbers of 16 bits
+ * limit to volumes under 256 MiB. %FS_FORMAT_V2 numbers blocks with 32 bits
+ * and records 64-bit file sizes, for volumes of several GiB. fs_mount() reads
+ * both formats.
+ *
+ * Only %FS_FORMAT_V2 records the block size, which can be any power of two
+ * from %BLOCK_SIZE_MIN to %BLOCK_SIZE_MAX (see disk.h). Large blocks suit
+ * large files: their chains are shorter, they are transferred with fewer
+ * calls and the FAT is smaller. Small blocks waste less space at the end of
+ * small files. %FS_FORMAT_V1 blocks are %BLOCK_SIZE bytes.
+ *
+ * The data blocks are not written, so that a large virtual disk file is
+ * sparse where the file system supports it.
+ *
+ * Return: -1 if @version is unknown, if @block_size is not valid for it, if
+ * @data_blocks is 0 or too large for it, or if the virtual disk file cannot be
+ * written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size,
+	      int version);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,6 +200,26 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of options
+ *
+ * Same as fs_mount(), with options. If @flags contains %FS_MOUNT_MMAP, the
+ * virtual disk file is mapped in memory: blocks are copied from and to the
+ * mapping instead of being transferred with a system call each, and the
+ * kernel's page cache decides which blocks stay in memory. This suits volumes
+ * which are mostly read.
+ *
+ * If @flags contains %FS_MOUNT_FLUSH, fs_write() leaves all of its data in the
+ * block cache, and a flusher thread owned by the mount writes it back along
+ * with the FAT and the root directory, as tuned by fs_set_writeback().
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened or mapped, or if
+ * no valid file system can be located. 0 otherwise.
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -36,6 +231,21 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write file system metadata to disk
+ *
+ * Write the FAT blocks that were modified since they were last written, the
+ * root directory if it was modified, and the data blocks held in the block
+ * cache to the virtual disk file, and wait until they are stored. Metadata is
+ * otherwise only written when unmounting, so calling fs_sync() regularly limits
+ * what a crash can lose. Its cost is proportional to what changed since the
+ * previous call.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if writing to it
+ * fails. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -72,6 +282,42 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_create_many - Create several files
+ * @filenames: Array of @count file names
+ * @count: Number of files to create
+ * @results: Array of @count results to fill
+ *
+ * Create the files named in @filenames, as fs_create() would, in a single pass
+ * over the root directory. @results[i] is set to 0 if @filenames[i] was created
+ * and to -1 if fs_create() would have failed for it; a name repeated in the
+ * batch is only created once. The root directory is then written once, and
+ * stored as by fs_sync(), so the new files are on disk without waiting for
+ * unmount.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @filenames or
+ * @results is NULL, if @count is negative, or if writing the root directory
+ * fails. Otherwise, the number of files created.
+ */
+int fs_create_many(const char **filenames, int count, int *results);
+
+/**
+ * fs_delete_many - Delete several files
+ * @filenames: Array of @count file names
+ * @count: Number of files to delete
+ * @results: Array of @count results to fill
+ *
+ * Delete the files named in @filenames, as fs_delete() would. @results[i] is
+ * set to 0 if @filenames[i] was deleted and to -1 if fs_delete() would have
+ * failed for it. The root directory and the FAT blocks that changed are then
+ * written once, a run of FAT blocks per transfer, and stored as by fs_sync().
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @filenames or
+ * @results is NULL, if @count is negative, or if writing the metadata fails.
+ * Otherwise, the number of files deleted.
+ */
+int fs_delete_many(const char **filenames, int count, int *results);
+
 /**
  * fs_ls - List files on file system
  *
@@ -103,13 +349,70 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Root directory updates deferred by fs_write() are
+ * written to disk.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if asynchronous requests on it were not returned by fs_aio_poll()
+ * yet. 0 otherwise.
  */
 int fs_close(int fd);
 
+/**
+ * fs_fsync - Write a file's pending updates to disk
+ * @fd: File descriptor
+ *
+ * Write the data and metadata of the file referenced by file descriptor @fd
+ * that have not reached the virtual disk file yet: its data blocks held in the
+ * block cache, the FAT blocks describing its chain and its root directory
+ * entry. Pending updates of other files may be written along with it.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if writing to the disk fails. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_set_writethrough - Choose when a file's directory entry is written
+ * @fd: File descriptor
+ * @enable: Non-zero to write the directory entry synchronously
+ *
+ * By default, the size and first data block changes made by fs_write() and
+ * fs_fallocate() are kept in memory and written to disk by fs_close(),
+ * fs_fsync(), fs_sync() or fs_umount(). When @enable is non-zero, writes
+ * through file descriptor @fd update the root directory on disk before
+ * returning instead. Descriptors returned by fs_open() start with write-through
+ * disabled.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). 0 otherwise.
+ */
+int fs_set_writethrough(int fd, int enable);
+
+/**
+ * fs_set_writeback - Tune the background flusher
+ * @expire_ms: Age, in milliseconds, from which dirty data is written back
+ * @background_ratio: Percentage of the block cache which can be dirty before
+ * the flusher writes back data regardless of its age
+ * @dirty_ratio: Percentage of the block cache which can be dirty before writers
+ * have to write back data themselves
+ *
+ * The flusher started by %FS_MOUNT_FLUSH wakes up every @expire_ms / 2
+ * milliseconds to write the FAT and root directory changes, and the data which
+ * has been dirty for @expire_ms. Writers wake it up early when they take the
+ * cache over @background_ratio. Data is written in block order, consecutive
+ * blocks with a single transfer. Data held over @dirty_ratio is written back by
+ * the writer, which bounds the amount of data lost if the program stops
+ * without calling fs_sync() or fs_umount(). The defaults are 1000 ms, 10% and
+ * 50%.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if it was not mounted
+ * with %FS_MOUNT_FLUSH, if @expire_ms is 0 or if the ratios are not such that
+ * 0 < @background_ratio <= @dirty_ratio <= 100. 0 otherwise.
+ */
+int fs_set_writeback(unsigned int expire_ms, unsigned int background_ratio,
+		     unsigned int dirty_ratio);
+
 /**
  * fs_stat - Get file status
  * @fd: File descriptor
@@ -117,10 +420,22 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the current size of file.
+ * open), or if the size of the file does not fit in an int, see fs_stat64().
+ * Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_stat64 - Get file status of a large file
+ * @fd: File descriptor
+ *
+ * Same as fs_stat(), for files whose size may not fit in an int.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the current size of file.
+ */
+int64_t fs_stat64(int fd);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -151,6 +466,7 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * At most INT_MAX bytes are written per call.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -169,12 +485,312 @@ int fs_write(int fd, void *buf, size_t count);
  *
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
- * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * is at the end of the file), and at most INT_MAX bytes are read per call.
+ * The file offset of the file descriptor is implicitly incremented by the
+ * number of bytes that were actually read.
+ *
+ * While reads through @fd follow each other, the blocks after them are read
+ * ahead in the background, in a window that grows as the file is streamed.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_write() with the concatenation of the @iovcnt buffers described by
+ * @iov, without copying them into one: the file is walked once, whole blocks
+ * are written straight from the buffers even when they straddle several of
+ * them, and a partial block is read and written once.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iovcnt is negative, or if the buffers add up to more than INT_MAX
+ * bytes. Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_read() into the concatenation of the @iovcnt buffers described by
+ * @iov, in a single pass over the file.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iovcnt is negative, or if the buffers add up to more than INT_MAX
+ * bytes. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read at
+ *
+ * Same as fs_read(), reading at @offset instead of the file offset of @fd,
+ * which is neither used nor changed. The state of @fd is not touched at all,
+ * so several threads can read through the same file descriptor at once
+ * without fs_lseek(), and without readahead.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read, 0 if @offset is
+ * at or beyond the end of the file.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), writing at @offset instead of the file offset of @fd,
+ * which is neither used nor changed.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is beyond the end of the file. Otherwise return the
+ * number of bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_read_view - Access file data without copying it
+ * @fd: File descriptor
+ * @offset: File offset of the first byte of the view
+ * @count: Number of bytes of data to view
+ * @view: View to fill
+ *
+ * Fill @view with segments pointing directly at the data of the file
+ * referenced by file descriptor @fd, from @offset and for @count bytes or up to
+ * the end of the file. The segments point into the block cache, or into the
+ * mapping of a file system mounted with %FS_MOUNT_MMAP where consecutive blocks
+ * form a single segment. The underlying blocks are pinned in memory until the
+ * view is released with fs_release_view(), which must happen before the file
+ * system is unmounted. The data must not be modified through the view, and
+ * the view reflects later writes to the same bytes. The file offset of the
+ * file descriptor is not used nor changed.
+ *
+ * Unless the file system is mounted with %FS_MOUNT_MMAP, each block of the view
+ * holds a slot of the block cache, and the views held at any time may pin at
+ * most half of the cache's blocks so that other reads and writes can proceed.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the blocks cannot be pinned (the block cache is disabled, or
+ * the view would take the views over half of it). Otherwise return the number
+ * of bytes in the view.
+ */
+int fs_read_view(int fd, size_t offset, size_t count, struct fs_view *view);
+
+/**
+ * fs_release_view - Release a view of file data
+ * @view: View filled by fs_read_view()
+ *
+ * Unpin the blocks referenced by @view and free its segments.
+ *
+ * Return: -1 if @view is invalid. 0 otherwise.
+ */
+int fs_release_view(struct fs_view *view);
+
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @len: Number of bytes the file should be able to hold
+ *
+ * Make sure that the file referenced by file descriptor @fd has enough data
+ * blocks to hold @len bytes, allocating the missing blocks in as few
+ * contiguous runs as possible, right after the file's last block when they
+ * are free. The size of the file is not changed: the reserved blocks are
+ * used by later calls to fs_write() instead of allocating new ones. Reserving
+ * a large file up front therefore lays it out contiguously on disk, which
+ * makes sequential reads faster.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there are not enough free data blocks (nothing is reserved
+ * then). 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t len);
+
+/**
+ * fs_aio_setup - Start the asynchronous request engine
+ * @depth: Maximum number of disk transfers in flight
+ * @flags: Bitwise or of options
+ *
+ * Prepare the mounted file system for fs_read_async() and fs_write_async().
+ * Requests are handed to the kernel through io_uring when it is available, or
+ * to a pool of threads otherwise or if @flags contains %FS_AIO_THREADS. On a
+ * file system mounted with %FS_MOUNT_MMAP, requests complete immediately.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the engine is already
+ * running, or if it cannot be started. 0 otherwise.
+ */
+int fs_aio_setup(unsigned int depth, int flags);
+
+/**
+ * fs_aio_teardown - Stop the asynchronous request engine
+ *
+ * Wait for the requests in flight and stop the engine. Completions not
+ * collected with fs_aio_poll() are dropped. fs_umount() stops the engine if
+ * needed.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if the engine is not
+ * running. 0 otherwise.
+ */
+int fs_aio_teardown(void);
+
+/**
+ * fs_read_async - Read from a file asynchronously
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ * @user: Cookie returned with the completion
+ *
+ * Start reading @count bytes of data at @offset in the file referenced by file
+ * descriptor @fd into @buf, like fs_read() would. Whole blocks are transferred
+ * in the background, so @buf must stay valid until the completion is returned
+ * by fs_aio_poll(). Parts of blocks are read before returning. The file offset
+ * of the file descriptor is not used nor changed, and @fd cannot be closed
+ * until the completion is returned.
+ *
+ * Return: -1 if the engine is not running, or if file descriptor @fd is invalid
+ * (out of bounds or not currently open). 0 otherwise.
+ */
+int fs_read_async(int fd, void *buf, size_t count, size_t offset, void *user);
+
+/**
+ * fs_write_async - Write to a file asynchronously
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ * @user: Cookie returned with the completion
+ *
+ * Start writing @count bytes of data from @buf at @offset in the file
+ * referenced by file descriptor @fd, like fs_write() would. Blocks are
+ * allocated before returning, and the file size grows once the data is written.
+ * @buf must stay valid until the completion is returned by fs_aio_poll(). The
+ * file offset of the file descriptor is not used nor changed, and @fd cannot be
+ * closed until the completion is returned.
+ *
+ * Return: -1 if the engine is not running, if file descriptor @fd is invalid
+ * (out of bounds or not currently open), or if @offset is beyond the end of the
+ * file. 0 otherwise.
+ */
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset,
+		   void *user);
+
+/**
+ * fs_aio_poll - Collect completed asynchronous requests
+ * @events: Array to fill with completions
+ * @max: Number of entries in @events
+ * @min: Number of completions to wait for
+ *
+ * Fill @events with up to @max completed requests, waiting until at least @min
+ * of them (or all the requests in flight if there are fewer) have completed.
+ *
+ * Return: -1 if the engine is not running. Otherwise return the number of
+ * entries filled in @events.
+ */
+int fs_aio_poll(struct fs_aio_event *events, int max, int min);
+
+/**
+ * fs_stats - Get runtime statistics
+ * @stats: Statistics to fill
+ *
+ * Fill @stats with what every file system of the process did since the last
+ * call to fs_stats_reset(), whether it was used with the _ctx functions or
+ * not. Percentiles are estimated from the latency histogram and are within a
+ * factor of two of the exact value; @max_ns is exact. Counters are updated
+ * without locking, so calls that are still running may only be partly
+ * accounted for.
+ *
+ * Statistics cost two clock reads per call. Building the library with
+ * NO_STATS defined (`make STATS=0`) removes them entirely.
+ *
+ * Return: -1 if the library was built without statistics, in which case
+ * @stats is zeroed. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats_reset - Reset runtime statistics
+ */
+void fs_stats_reset(void);
+
+/**
+ * fs_op_name - Name of an operation
+ * @op: Operation, from enum fs_op
+ *
+ * Return: the name of the public function performing @op, without its fs_
+ * prefix, or NULL if @op is out of bounds.
+ */
+const char *fs_op_name(int op);
+
+/**
+ * fs_mount_ctx - Mount a file system as an independent context
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of options, as for fs_mount_flags()
+ *
+ * Mount the file system contained in virtual disk file @diskname, independently
+ * of the one mounted with fs_mount() and of other contexts. The context is
+ * passed to the _ctx functions below and is freed by fs_umount_ctx(). A given
+ * virtual disk file must not be mounted twice at the same time.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened or mapped, or
+ * if no valid file system can be located. Otherwise, the mounted context.
+ */
+fs_t *fs_mount_ctx(const char *diskname, int flags);
+
+/*
+ * The following functions behave like the function of the same name without
+ * _ctx, on file system @fs. They fail if @fs is NULL.
+ */
+int fs_umount_ctx(fs_t *fs);
+int fs_sync_ctx(fs_t *fs);
+int fs_info_ctx(fs_t *fs);
+int fs_create_ctx(fs_t *fs, const char *filename);
+int fs_delete_ctx(fs_t *fs, const char *filename);
+int fs_create_many_ctx(fs_t *fs, const char **filenames, int count,
+		       int *results);
+int fs_delete_many_ctx(fs_t *fs, const char **filenames, int count,
+		       int *results);
+int fs_ls_ctx(fs_t *fs);
+int fs_open_ctx(fs_t *fs, const char *filename);
+int fs_close_ctx(fs_t *fs, int fd);
+int fs_fsync_ctx(fs_t *fs, int fd);
+int fs_set_writethrough_ctx(fs_t *fs, int fd, int enable);
+int fs_set_writeback_ctx(fs_t *fs, unsigned int expire_ms,
+			 unsigned int background_ratio, unsigned int dirty_ratio);
+int fs_stat_ctx(fs_t *fs, int fd);
+int64_t fs_stat64_ctx(fs_t *fs, int fd);
+int fs_lseek_ctx(fs_t *fs, int fd, size_t offset);
+int fs_write_ctx(fs_t *fs, int fd, void *buf, size_t count);
+int fs_read_ctx(fs_t *fs, int fd, void *buf, size_t count);
+int fs_writev_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+int fs_readv_ctx(fs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+int fs_pread_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset);
+int fs_pwrite_ctx(fs_t *fs, int fd, const void *buf, size_t count,
+		  size_t offset);
+int fs_read_view_ctx(fs_t *fs, int fd, size_t offset, size_t count,
+		     struct fs_view *view);
+int fs_release_view_ctx(fs_t *fs, struct fs_view *view);
+int fs_fallocate_ctx(fs_t *fs, int fd, size_t len);
+int fs_aio_setup_ctx(fs_t *fs, unsigned int depth, int flags);
+int fs_aio_teardown_ctx(fs_t *fs);
+int fs_read_async_ctx(fs_t *fs, int fd, void *buf, size_t count, size_t offset,
+		      void *user);
+int fs_write_async_ctx(fs_t *fs, int fd, const void *buf, size_t count,
+		       size_t offset, void *user);
+int fs_aio_poll_ctx(fs_t *fs, struct fs_aio_event *events, int max, int min);
+
 #endif /* _FS_H */
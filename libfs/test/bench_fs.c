@@ -0,0 +1,563 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Largest number of data blocks a file system can have */
+#define MAX_DATA_BLOCKS 8192
+
+/* Size of the files used by the throughput benchmarks */
+#define XFER_FILE_SIZE (16 * 1024 * 1024)
+
+/* One measurement */
+struct result {
+	const char *bench;
+	char param[32];
+	double value;
+	const char *unit;
+};
+
+static struct result *results;
+static size_t nresults;
+
+/* Directory where the scratch disk images are created */
+static const char *scratch_dir = ".";
+static char diskname[4096];
+
+/* Block size of the scratch file systems, other than BLOCK_SIZE with -b */
+static size_t block_size = BLOCK_SIZE;
+
+static void record(const char *bench, const char *unit, double value,
+		   const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+static void record(const char *bench, const char *unit, double value,
+		   const char *fmt, ...)
+{
+	struct result *r;
+	va_list ap;
+
+	results = realloc(results, (nresults + 1) * sizeof(*results));
+	if (!results)
+		die_perror("realloc");
+
+	r = &results[nresults++];
+	r->bench = bench;
+	r->unit = unit;
+	r->value = value;
+	va_start(ap, fmt);
+	vsnprintf(r->param, sizeof(r->param), fmt, ap);
+	va_end(ap);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Create an empty file system with @ndata data blocks in the scratch disk
+ * image, with the same layout as fs_make.x. Other block sizes need the
+ * version 2 format, made by fs_format().
+ */
+static void bench_format(size_t ndata)
+{
+	size_t nfat = (ndata * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t total = 1 + nfat + 1 + ndata;
+	uint8_t *block;
+	uint16_t *sb;
+	FILE *f;
+
+	if (block_size != BLOCK_SIZE) {
+		if (fs_format(diskname, ndata, block_size, FS_FORMAT_V2))
+			die("Cannot format diskname");
+		return;
+	}
+
+	block = calloc(1, BLOCK_SIZE);
+	if (!block)
+		die_perror("calloc");
+
+	f = fopen(diskname, "wb");
+	if (!f)
+		die_perror("fopen");
+
+	/* Superblock */
+	memcpy(block, "ECS150FS", 8);
+	sb = (uint16_t *)(block + 8);
+	sb[0] = total;
+	sb[1] = 1 + nfat;
+	sb[2] = 2 + nfat;
+	sb[3] = ndata;
+	block[16] = nfat;
+	if (fwrite(block, BLOCK_SIZE, 1, f) != 1)
+		die_perror("fwrite");
+
+	/* FAT, whose first entry is never used, then root directory and data */
+	memset(block, 0, BLOCK_SIZE);
+	((uint16_t *)block)[0] = 0xFFFF;
+	for (size_t i = 1; i < total; i++) {
+		if (fwrite(block, BLOCK_SIZE, 1, f) != 1)
+			die_perror("fwrite");
+		((uint16_t *)block)[0] = 0;
+	}
+
+	if (fclose(f))
+		die_perror("fclose");
+	free(block);
+}
+
+static void bench_mount(void)
+{
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+}
+
+static void bench_umount(void)
+{
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+static int bench_open(const char *filename)
+{
+	int fd = fs_open(filename);
+
+	if (fd < 0)
+		die("Cannot open file");
+	return fd;
+}
+
+/* Fill file @filename with @size bytes of @buf */
+static void bench_fill(const char *filename, const char *buf, size_t size)
+{
+	int fd;
+
+	if (fs_create(filename))
+		die("Cannot create file");
+	fd = bench_open(filename);
+	if (fs_write(fd, (void *)buf, size) != (int)size)
+		die("Cannot write file");
+	if (fs_close(fd))
+		die("Cannot close file");
+}
+
+/*
+ * Sequential and random fs_write()/fs_read() throughput, for several request
+ * sizes. Random requests are aligned on the request size. Writes are timed
+ * until they reach the disk image, reads start from a fresh mount.
+ */
+static void bench_xfer(void)
+{
+	static const size_t req_sizes[] = { 512, 4096, 65536, 1024 * 1024 };
+	size_t nreq, *offsets;
+	char *buf;
+	double t;
+	int fd;
+
+	buf = malloc(XFER_FILE_SIZE);
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 'x', XFER_FILE_SIZE);
+
+	for (size_t i = 0; i < ARRAY_SIZE(req_sizes); i++) {
+		size_t req = req_sizes[i];
+
+		nreq = XFER_FILE_SIZE / req;
+		offsets = malloc(nreq * sizeof(size_t));
+		if (!offsets)
+			die_perror("malloc");
+		for (size_t j = 0; j < nreq; j++)
+			offsets[j] = (size_t)(rand() % nreq) * req;
+
+		bench_format(MAX_DATA_BLOCKS);
+		bench_mount();
+
+		/* Sequential write, growing the file */
+		if (fs_create("seq"))
+			die("Cannot create file");
+		fd = bench_open("seq");
+		t = now();
+		for (size_t j = 0; j < nreq; j++)
+			if (fs_write(fd, buf + j * req, req) != (int)req)
+				die("Cannot write file");
+		if (fs_fsync(fd))
+			die("Cannot sync file");
+		t = now() - t;
+		record("seq_write", "MB/s", XFER_FILE_SIZE / t / 1e6,
+		       "req=%zu", req);
+
+		/* Random write, over the existing data */
+		t = now();
+		for (size_t j = 0; j < nreq; j++) {
+			fs_lseek(fd, offsets[j]);
+			if (fs_write(fd, buf, req) != (int)req)
+				die("Cannot write file");
+		}
+		if (fs_fsync(fd))
+			die("Cannot sync file");
+		t = now() - t;
+		record("rand_write", "MB/s", XFER_FILE_SIZE / t / 1e6,
+		       "req=%zu", req);
+
+		if (fs_close(fd))
+			die("Cannot close file");
+		bench_umount();
+
+		/* Sequential read */
+		bench_mount();
+		fd = bench_open("seq");
+		t = now();
+		for (size_t j = 0; j < nreq; j++)
+			if (fs_read(fd, buf, req) != (int)req)
+				die("Cannot read file");
+		t = now() - t;
+		record("seq_read", "MB/s", XFER_FILE_SIZE / t / 1e6,
+		       "req=%zu", req);
+		if (fs_close(fd))
+			die("Cannot close file");
+		bench_umount();
+
+		/* Random read */
+		bench_mount();
+		fd = bench_open("seq");
+		t = now();
+		for (size_t j = 0; j < nreq; j++) {
+			fs_lseek(fd, offsets[j]);
+			if (fs_read(fd, buf, req) != (int)req)
+				die("Cannot read file");
+		}
+		t = now() - t;
+		record("rand_read", "MB/s", XFER_FILE_SIZE / t / 1e6,
+		       "req=%zu", req);
+		if (fs_close(fd))
+			die("Cannot close file");
+		bench_umount();
+
+		free(offsets);
+	}
+
+	free(buf);
+}
+
+/*
+ * fs_create(), fs_delete() and fs_open()/fs_close() rates as the root
+ * directory fills up. At each level, a quarter of the directory is created and
+ * deleted again a number of times, then every file is opened and closed.
+ */
+static void bench_namespace(void)
+{
+	const size_t quarter = FS_FILE_MAX_COUNT / 4;
+	const int reps = 200;
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	double tc, td, t;
+	int fd;
+
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+		snprintf(names[i], FS_FILENAME_LEN, "file%zu", i);
+
+	bench_format(256);
+	bench_mount();
+
+	for (size_t level = 0; level < FS_FILE_MAX_COUNT; level += quarter) {
+		tc = td = 0;
+		for (int r = 0; r < reps; r++) {
+			t = now();
+			for (size_t i = level; i < level + quarter; i++)
+				if (fs_create(names[i]))
+					die("Cannot create file");
+			tc += now() - t;
+
+			/* The last round leaves the files for the next level */
+			if (r == reps - 1)
+				break;
+
+			t = now();
+			for (size_t i = level; i < level + quarter; i++)
+				if (fs_delete(names[i]))
+					die("Cannot delete file");
+			td += now() - t;
+		}
+		record("create", "ops/s", quarter * reps / tc, "files=%zu", level);
+		record("delete", "ops/s", quarter * (reps - 1) / td, "files=%zu",
+		       level);
+
+		t = now();
+		for (int r = 0; r < reps; r++) {
+			for (size_t i = 0; i < level + quarter; i++) {
+				fd = bench_open(names[i]);
+				if (fs_close(fd))
+					die("Cannot close file");
+			}
+		}
+		t = now() - t;
+		record("open_close", "ops/s", (level + quarter) * reps / t,
+		       "files=%zu", level + quarter);
+	}
+
+	bench_umount();
+}
+
+/*
+ * Latency of fs_lseek() to a random offset followed by a small fs_read(), in
+ * files with chains of different lengths
+ */
+static void bench_seek(void)
+{
+	static const size_t chain_lens[] = { 16, 256, 4096, MAX_DATA_BLOCKS - 1 };
+	const int iters = 20000;
+	char *buf;
+	double t;
+	int fd;
+
+	buf = calloc(MAX_DATA_BLOCKS, block_size);
+	if (!buf)
+		die_perror("calloc");
+
+	for (size_t i = 0; i < ARRAY_SIZE(chain_lens); i++) {
+		size_t size = chain_lens[i] * block_size;
+		char c;
+
+		bench_format(MAX_DATA_BLOCKS);
+		bench_mount();
+		bench_fill("chain", buf, size);
+		fd = bench_open("chain");
+
+		t = now();
+		for (int j = 0; j < iters; j++) {
+			fs_lseek(fd, (size_t)rand() % size);
+			if (fs_read(fd, &c, 1) != 1)
+				die("Cannot read file");
+		}
+		t = now() - t;
+		record("lseek_read", "us", t / iters * 1e6, "blocks=%zu",
+		       chain_lens[i]);
+
+		if (fs_close(fd))
+			die("Cannot close file");
+		bench_umount();
+	}
+
+	free(buf);
+}
+
+/* fs_mount() and fs_umount() time for several disk sizes */
+static void bench_mount_time(void)
+{
+	static const size_t disk_sizes[] = { 64, 512, 4096, MAX_DATA_BLOCKS };
+	const int iters = 200;
+	double tm, tu, t;
+
+	for (size_t i = 0; i < ARRAY_SIZE(disk_sizes); i++) {
+		bench_format(disk_sizes[i]);
+
+		tm = tu = 0;
+		for (int j = 0; j < iters; j++) {
+			t = now();
+			bench_mount();
+			tm += now() - t;
+
+			t = now();
+			bench_umount();
+			tu += now() - t;
+		}
+		record("mount", "us", tm / iters * 1e6, "blocks=%zu",
+		       disk_sizes[i]);
+		record("umount", "us", tu / iters * 1e6, "blocks=%zu",
+		       disk_sizes[i]);
+	}
+}
+
+static void print_csv(void)
+{
+	printf("bench,param,value,unit\n");
+	for (size_t i = 0; i < nresults; i++)
+		printf("%s,%s,%.3f,%s\n", results[i].bench, results[i].param,
+		       results[i].value, results[i].unit);
+}
+
+static void print_json(void)
+{
+	printf("[\n");
+	for (size_t i = 0; i < nresults; i++)
+		printf("  {\"bench\": \"%s\", \"param\": \"%s\", "
+		       "\"value\": %.3f, \"unit\": \"%s\"}%s\n",
+		       results[i].bench, results[i].param, results[i].value,
+		       results[i].unit, i + 1 < nresults ? "," : "");
+	printf("]\n");
+}
+
+/*
+ * Create and delete a full root directory, storing each change on disk: one
+ * file at a time followed by fs_sync(), or with the batch calls
+ */
+static void bench_batch(void)
+{
+	const int reps = 20;
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	const char *list[FS_FILE_MAX_COUNT];
+	int res[FS_FILE_MAX_COUNT];
+	double tc = 0, td = 0, t;
+
+	for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		snprintf(names[i], FS_FILENAME_LEN, "file%zu", i);
+		list[i] = names[i];
+	}
+
+	bench_format(256);
+	bench_mount();
+
+	for (int r = 0; r < reps; r++) {
+		t = now();
+		for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+			if (fs_create(names[i]) || fs_sync())
+				die("Cannot create file");
+		tc += now() - t;
+
+		t = now();
+		for (size_t i = 0; i < FS_FILE_MAX_COUNT; i++)
+			if (fs_delete(names[i]) || fs_sync())
+				die("Cannot delete file");
+		td += now() - t;
+	}
+	record("batch", "ops/s", FS_FILE_MAX_COUNT * reps / tc, "create");
+	record("batch", "ops/s", FS_FILE_MAX_COUNT * reps / td, "delete");
+
+	tc = td = 0;
+	for (int r = 0; r < reps; r++) {
+		t = now();
+		if (fs_create_many(list, FS_FILE_MAX_COUNT, res) !=
+		    FS_FILE_MAX_COUNT)
+			die("Cannot create files");
+		tc += now() - t;
+
+		t = now();
+		if (fs_delete_many(list, FS_FILE_MAX_COUNT, res) !=
+		    FS_FILE_MAX_COUNT)
+			die("Cannot delete files");
+		td += now() - t;
+	}
+	record("batch", "ops/s", FS_FILE_MAX_COUNT * reps / tc, "create_many");
+	record("batch", "ops/s", FS_FILE_MAX_COUNT * reps / td, "delete_many");
+
+	bench_umount();
+}
+
+static struct {
+	const char *name;
+	void(*func)(void);
+} benches[] = {
+	{ "xfer",	bench_xfer },
+	{ "namespace",	bench_namespace },
+	{ "batch",	bench_batch },
+	{ "seek",	bench_seek },
+	{ "mount",	bench_mount_time },
+};
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s [-f csv|json] [-d <scratch dir>] [-t <trace>] "
+		"[-b <block size>] [<bench>...]\n", program);
+	fprintf(stderr, "Possible benchmarks are (all by default):\n");
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, "\t%s\n", benches[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, json = 0, all;
+	const char *trace = NULL;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "f:d:t:b:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp(optarg, "json"))
+				json = 1;
+			else if (strcmp(optarg, "csv"))
+				usage(argv[0]);
+			break;
+		case 'd':
+			scratch_dir = optarg;
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* Check the names before spending time on any benchmark */
+	for (int a = optind; a < argc; a++) {
+		for (i = 0; i < ARRAY_SIZE(benches); i++)
+			if (!strcmp(argv[a], benches[i].name))
+				break;
+		if (i == ARRAY_SIZE(benches)) {
+			bench_error("invalid benchmark '%s'", argv[a]);
+			usage(argv[0]);
+		}
+	}
+
+	snprintf(diskname, sizeof(diskname), "%s/bench_%d.fs", scratch_dir,
+		 (int)getpid());
+	srand(1);
+
+	/* Record the block transfers, to be replayed with replay_fs.x */
+	if (trace && block_trace_start(trace))
+		die("cannot start trace");
+
+	all = optind == argc;
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		int run = all;
+
+		for (int a = optind; a < argc; a++)
+			if (!strcmp(argv[a], benches[i].name))
+				run = 1;
+		if (run)
+			benches[i].func();
+	}
+
+	if (trace && block_trace_stop())
+		die("cannot write trace");
+
+	unlink(diskname);
+
+	if (json)
+		print_json();
+	else
+		print_csv();
+
+	free(results);
+	return 0;
+}
@@ -0,0 +1,291 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Labels recorded by block_trace_tag(), the file system's are op + 1 */
+#define NTAGS 256
+
+/* Latencies of the replayed transfers of one kind */
+struct lat {
+	uint64_t *ns;
+	size_t count;
+	uint64_t blocks;
+};
+
+/* Replayed transfers of one label */
+struct tag_stats {
+	uint64_t count;
+	uint64_t blocks;
+	uint64_t ns;
+};
+
+static struct block_trace_rec *recs;
+static size_t nrecs;
+static size_t bsize;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void load_trace(const char *path)
+{
+	struct block_trace_header hdr;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		die_perror("fopen");
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+		die("cannot read trace header");
+	if (memcmp(hdr.magic, BLOCK_TRACE_MAGIC, sizeof(hdr.magic)))
+		die("not a block trace: %s", path);
+	if (hdr.version != BLOCK_TRACE_VERSION)
+		die("unsupported trace version %u", hdr.version);
+	if (hdr.block_size < BLOCK_SIZE_MIN || hdr.block_size > BLOCK_SIZE_MAX)
+		die("unsupported trace block size %u", hdr.block_size);
+	bsize = hdr.block_size;
+
+	if (fstat(fileno(f), &st))
+		die_perror("fstat");
+	nrecs = (st.st_size - sizeof(hdr)) / sizeof(*recs);
+	recs = malloc(nrecs * sizeof(*recs) + 1);
+	if (!recs)
+		die_perror("malloc");
+	if (fread(recs, sizeof(*recs), nrecs, f) != nrecs)
+		die("cannot read trace records");
+
+	fclose(f);
+}
+
+/* Make @path a disk image covering every block the trace transfers */
+static void prepare_image(const char *path)
+{
+	size_t end = 0;
+	struct stat st;
+	int fd;
+
+	for (size_t i = 0; i < nrecs; i++)
+		if (recs[i].block + (size_t)recs[i].nblocks > end)
+			end = recs[i].block + (size_t)recs[i].nblocks;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if ((size_t)st.st_size < end * bsize && ftruncate(fd, end * bsize))
+		die_perror("ftruncate");
+	close(fd);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_lat(const char *name, struct lat *l)
+{
+	if (!l->count)
+		return;
+
+	qsort(l->ns, l->count, sizeof(*l->ns), cmp_u64);
+	printf("%-9s %9zu %10llu %9.1f %9.1f %9.1f\n", name, l->count,
+	       (unsigned long long)l->blocks,
+	       l->ns[l->count / 2] / 1e3,
+	       l->ns[l->count * 99 / 100] / 1e3,
+	       l->ns[l->count - 1] / 1e3);
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-m] [-c <cache blocks>] [-w <dirty blocks>] "
+		"[-p] <trace> <scratch image>\n", program);
+	fprintf(stderr, "\t-m\tmap the image in memory\n");
+	fprintf(stderr, "\t-c\tblock cache size\n");
+	fprintf(stderr, "\t-w\tdirty blocks left in the cache before writing "
+		"back\n");
+	fprintf(stderr, "\t-p\tkeep the recorded pace instead of replaying "
+		"as fast as possible\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct lat lat[3] = { { 0 } };
+	static struct tag_stats tags[NTAGS];
+	struct block_cache_stats cs;
+	long cache = -1, dirty = 0;
+	int opt, flags = 0, pace = 0;
+	size_t maxblocks = 1, i;
+	uint64_t start, t0, t, elapsed;
+	struct disk *disk;
+	struct iovec iov;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "mc:w:ph")) != -1) {
+		switch (opt) {
+		case 'm':
+			flags |= BLOCK_DISK_MMAP;
+			break;
+		case 'c':
+			cache = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			dirty = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			pace = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	load_trace(argv[optind]);
+	prepare_image(argv[optind + 1]);
+
+	for (i = 0; i < nrecs; i++)
+		if (recs[i].nblocks > maxblocks)
+			maxblocks = recs[i].nblocks;
+	buf = malloc(maxblocks * bsize);
+	for (i = 0; i < 3; i++)
+		lat[i].ns = malloc((nrecs + 1) * sizeof(uint64_t));
+	if (!buf || !lat[0].ns || !lat[1].ns || !lat[2].ns)
+		die_perror("malloc");
+	for (i = 0; i < maxblocks * bsize; i++)
+		buf[i] = (char)i;
+
+	if (cache >= 0 && block_cache_resize(cache))
+		die("cannot resize the block cache");
+	disk = disk_open_block_size(argv[optind + 1], flags, bsize);
+	if (!disk)
+		die("cannot open scratch image");
+	if (dirty && disk_dirty_limit(disk, dirty))
+		die("cannot set the dirty limit");
+
+	/* Asynchronous transfers are replayed synchronously, in trace order */
+	start = now_ns();
+	for (i = 0; i < nrecs; i++) {
+		struct block_trace_rec *r = &recs[i];
+		int kind = r->op & ~BLOCK_TRACE_ASYNC, ret;
+
+		if (kind > BLOCK_TRACE_PREFETCH)
+			die("invalid record %zu", i);
+
+		if (pace) {
+			struct timespec ts;
+
+			t = now_ns() - start;
+			if (t < r->time_ns) {
+				ts.tv_sec = (r->time_ns - t) / 1000000000;
+				ts.tv_nsec = (r->time_ns - t) % 1000000000;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		iov.iov_base = buf;
+		iov.iov_len = (size_t)r->nblocks * bsize;
+		t0 = now_ns();
+		if (kind == BLOCK_TRACE_READ)
+			ret = disk_readv(disk, r->block, &iov, 1);
+		else if (kind == BLOCK_TRACE_WRITE)
+			ret = disk_writev(disk, r->block, &iov, 1);
+		else
+			ret = disk_prefetch(disk, r->block, r->nblocks);
+		t = now_ns() - t0;
+		if (ret)
+			die("transfer %zu failed", i);
+
+		lat[kind].ns[lat[kind].count++] = t;
+		lat[kind].blocks += r->nblocks;
+		tags[r->tag].count++;
+		tags[r->tag].blocks += r->nblocks;
+		tags[r->tag].ns += t;
+	}
+
+	/* What the trace wrote is only replayed once it is stored */
+	t0 = now_ns();
+	if (disk_sync(disk))
+		die("cannot sync scratch image");
+	t = now_ns() - t0;
+	elapsed = now_ns() - start;
+
+	printf("trace: %zu records over %.3f s\n", nrecs,
+	       nrecs ? recs[nrecs - 1].time_ns / 1e9 : 0.0);
+	printf("replay: %.3f s (sync %.3f s), read %.1f MB/s, "
+	       "written %.1f MB/s\n\n", elapsed / 1e9, t / 1e9,
+	       lat[BLOCK_TRACE_READ].blocks * bsize / 1e6 / (elapsed / 1e9),
+	       lat[BLOCK_TRACE_WRITE].blocks * bsize / 1e6 / (elapsed / 1e9));
+
+	printf("%-9s %9s %10s %9s %9s %9s\n", "transfer", "count", "blocks",
+	       "p50_us", "p99_us", "max_us");
+	print_lat("read", &lat[BLOCK_TRACE_READ]);
+	print_lat("write", &lat[BLOCK_TRACE_WRITE]);
+	print_lat("prefetch", &lat[BLOCK_TRACE_PREFETCH]);
+
+	printf("\n%-16s %9s %10s %9s\n", "label", "count", "blocks", "total_ms");
+	for (i = 0; i < NTAGS; i++) {
+		const char *name = i ? fs_op_name(i - 1) : "(none)";
+		char other[16];
+
+		if (!tags[i].count)
+			continue;
+		if (!name) {
+			snprintf(other, sizeof(other), "%zu", i);
+			name = other;
+		}
+		printf("%-16s %9llu %10llu %9.3f\n", name,
+		       (unsigned long long)tags[i].count,
+		       (unsigned long long)tags[i].blocks, tags[i].ns / 1e6);
+	}
+
+	if (!disk_cache_stats(disk, &cs))
+		printf("\ncache: %zu blocks, %zu hits, %zu misses, "
+		       "%zu evictions, %zu writebacks, %zu prefetched\n",
+		       cs.size, cs.hits, cs.misses, cs.evictions, cs.writebacks,
+		       cs.prefetched);
+
+	if (disk_close(disk))
+		die("cannot close scratch image");
+
+	free(buf);
+	for (i = 0; i < 3; i++)
+		free(lat[i].ns);
+	free(recs);
+
+	return 0;
+}
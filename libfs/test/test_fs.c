@@ -1,14 +1,18 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -38,7 +42,7 @@ void thread_fs_stat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
 	int fs_fd;
-	size_t stat;
+	int64_t stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -55,7 +59,7 @@ void thread_fs_stat(void *arg)
 		die("Cannot open file");
 	}
 
-	stat = fs_stat(fs_fd);
+	stat = fs_stat64(fs_fd);
 	if (stat < 0) {
 		fs_umount();
 		die("Cannot stat file");
@@ -74,7 +78,7 @@ void thread_fs_stat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Size of file '%s' is %zu bytes\n", filename, stat);
+	printf("Size of file '%s' is %zu bytes\n", filename, (size_t)stat);
 }
 
 void thread_fs_cat(void *arg)
@@ -221,6 +225,402 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/*
+ * Bulk transfers run as a pipeline: a stage of threads prepares files (maps
+ * host files, or reads files out of the file system) and hands them over
+ * through a bounded queue to a stage of threads that store them (in the file
+ * system, or on the host). Both stages use the same mount.
+ */
+#define BULK_THREADS 4
+#define BULK_QUEUE 16
+
+struct bulk_job {
+	/* Name in the file system, and path on the host */
+	const char *name;
+	char *path;
+	/* Content of the file, mapped from the host or read from the disk */
+	char *data;
+	size_t size;
+};
+
+struct bulk {
+	struct bulk_job *jobs;
+	size_t njobs;
+	/* Next job to prepare */
+	size_t next;
+	/* Prepared jobs, waiting to be stored */
+	struct bulk_job *queue[BULK_QUEUE];
+	size_t head, count;
+	/* Preparing threads still running */
+	int producers;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	/* Stage functions, returning -1 on failure */
+	int (*prepare)(struct bulk_job *job);
+	int (*store)(struct bulk_job *job);
+	size_t done, bytes;
+	int failed;
+};
+
+static void *bulk_producer(void *arg)
+{
+	struct bulk *b = arg;
+	struct bulk_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		job = b->next < b->njobs ? &b->jobs[b->next++] : NULL;
+		pthread_mutex_unlock(&b->lock);
+		if (!job)
+			break;
+
+		if (b->prepare(job)) {
+			pthread_mutex_lock(&b->lock);
+			b->failed++;
+			pthread_mutex_unlock(&b->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&b->lock);
+		while (b->count == BULK_QUEUE)
+			pthread_cond_wait(&b->not_full, &b->lock);
+		b->queue[(b->head + b->count++) % BULK_QUEUE] = job;
+		pthread_cond_signal(&b->not_empty);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	pthread_mutex_lock(&b->lock);
+	b->producers--;
+	pthread_cond_broadcast(&b->not_empty);
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+static void *bulk_consumer(void *arg)
+{
+	struct bulk *b = arg;
+	struct bulk_job *job;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		while (!b->count && b->producers)
+			pthread_cond_wait(&b->not_empty, &b->lock);
+		if (!b->count) {
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		job = b->queue[b->head];
+		b->head = (b->head + 1) % BULK_QUEUE;
+		b->count--;
+		pthread_cond_signal(&b->not_full);
+		pthread_mutex_unlock(&b->lock);
+
+		ret = b->store(job);
+
+		pthread_mutex_lock(&b->lock);
+		if (ret) {
+			b->failed++;
+		} else {
+			b->done++;
+			b->bytes += job->size;
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+/* Run the pipeline over every job, and print a summary */
+static void bulk_run(struct bulk *b, const char *what)
+{
+	pthread_t producers[BULK_THREADS], consumers[BULK_THREADS];
+	struct timespec t0, t1;
+	double secs;
+	int i;
+
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->not_empty, NULL);
+	pthread_cond_init(&b->not_full, NULL);
+	b->producers = BULK_THREADS;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BULK_THREADS; i++) {
+		if (pthread_create(&producers[i], NULL, bulk_producer, b) ||
+		    pthread_create(&consumers[i], NULL, bulk_consumer, b))
+			die("Cannot create thread");
+	}
+	for (i = 0; i < BULK_THREADS; i++) {
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%s %zu files (%zu bytes) in %.3f s, %.1f MB/s, %d failed\n",
+	       what, b->done, b->bytes, secs,
+	       secs > 0 ? b->bytes / 1e6 / secs : 0.0, b->failed);
+
+	pthread_cond_destroy(&b->not_full);
+	pthread_cond_destroy(&b->not_empty);
+	pthread_mutex_destroy(&b->lock);
+}
+
+static void bulk_add_job(struct bulk *b, const char *name, char *path)
+{
+	struct bulk_job *job;
+
+	b->jobs = realloc(b->jobs, (b->njobs + 1) * sizeof(*b->jobs));
+	if (!b->jobs)
+		die_perror("realloc");
+
+	job = &b->jobs[b->njobs++];
+	memset(job, 0, sizeof(*job));
+	job->name = name;
+	job->path = path;
+}
+
+static char *path_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = malloc(len);
+
+	if (!path)
+		die_perror("malloc");
+	snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+/* Map a host file, faulting its pages in */
+static int import_prepare(struct bulk_job *job)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(job->path, O_RDONLY);
+	if (fd < 0) {
+		perror(job->path);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	job->size = st.st_size;
+	if (job->size) {
+		job->data = mmap(NULL, job->size, PROT_READ,
+				 MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (job->data == MAP_FAILED) {
+			perror("mmap");
+			job->data = NULL;
+		}
+	}
+	close(fd);
+
+	return job->size && !job->data ? -1 : 0;
+}
+
+/* Write a mapped host file to its new file on the file system */
+static int import_store(struct bulk_job *job)
+{
+	int fs_fd, n, ret = 0;
+	size_t done = 0;
+
+	fs_fd = fs_open(job->name);
+	if (fs_fd < 0) {
+		test_fs_error("Cannot open file '%s'", job->name);
+		ret = -1;
+	} else {
+		/* Each call writes at most INT_MAX bytes */
+		while (done < job->size) {
+			n = fs_write(fs_fd, job->data + done, job->size - done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		if (done < job->size) {
+			test_fs_error("Cannot write file '%s'", job->name);
+			ret = -1;
+		}
+		if (fs_close(fs_fd))
+			ret = -1;
+	}
+
+	if (job->data)
+		munmap(job->data, job->size);
+	return ret;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct bulk b = { 0 };
+	const char **names;
+	struct dirent *de;
+	struct stat st;
+	int *results;
+	size_t i, j;
+	DIR *dir;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host dir|host filename...>");
+
+	/* Files of a directory keep their name, others their path as given */
+	for (int a = 1; a < t_arg->argc; a++) {
+		char *path = t_arg->argv[a];
+
+		if (stat(path, &st))
+			die_perror(path);
+		if (!S_ISDIR(st.st_mode)) {
+			bulk_add_job(&b, path, strdup(path));
+			continue;
+		}
+
+		dir = opendir(path);
+		if (!dir)
+			die_perror("opendir");
+		while ((de = readdir(dir))) {
+			char *file = path_join(path, de->d_name);
+
+			if (stat(file, &st) || !S_ISREG(st.st_mode)) {
+				free(file);
+				continue;
+			}
+			bulk_add_job(&b, file + strlen(path) + 1, file);
+		}
+		closedir(dir);
+	}
+
+	names = malloc(b.njobs * sizeof(*names));
+	results = malloc(b.njobs * sizeof(*results));
+	if (b.njobs && (!names || !results))
+		die_perror("malloc");
+	for (i = 0; i < b.njobs; i++)
+		names[i] = b.jobs[i].name;
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	/* Create every file at once, then only fill the ones created */
+	if (fs_create_many(names, b.njobs, results) < 0) {
+		fs_umount();
+		die("Cannot create files");
+	}
+	for (i = 0, j = 0; i < b.njobs; i++) {
+		if (!results[i]) {
+			b.jobs[j++] = b.jobs[i];
+			continue;
+		}
+		test_fs_error("Cannot create file '%s'", b.jobs[i].name);
+		free(b.jobs[i].path);
+		b.failed++;
+	}
+	b.njobs = j;
+
+	b.prepare = import_prepare;
+	b.store = import_store;
+	bulk_run(&b, "Imported");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (i = 0; i < b.njobs; i++)
+		free(b.jobs[i].path);
+	free(b.jobs);
+	free(names);
+	free(results);
+}
+
+/* Read a file of the file system into memory */
+static int export_prepare(struct bulk_job *job)
+{
+	int fs_fd, size, n, done = 0, ret = 0;
+
+	fs_fd = fs_open(job->name);
+	if (fs_fd < 0) {
+		test_fs_error("Cannot open file '%s'", job->name);
+		return -1;
+	}
+
+	size = fs_stat(fs_fd);
+	job->data = malloc(size > 0 ? size : 1);
+	while (job->data && done < size) {
+		n = fs_read(fs_fd, job->data + done, size - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	if (size < 0 || !job->data || done < size) {
+		test_fs_error("Cannot read file '%s'", job->name);
+		free(job->data);
+		job->data = NULL;
+		ret = -1;
+	}
+	job->size = size > 0 ? size : 0;
+
+	if (fs_close(fs_fd))
+		ret = -1;
+	return ret;
+}
+
+/* Write a file read out of the file system to the host */
+static int export_store(struct bulk_job *job)
+{
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(job->path);
+		free(job->data);
+		return -1;
+	}
+
+	while (done < job->size) {
+		n = write(fd, job->data + done, job->size - done);
+		if (n < 0) {
+			perror("write");
+			break;
+		}
+		done += n;
+	}
+
+	free(job->data);
+	return close(fd) || done < job->size ? -1 : 0;
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct bulk b = { 0 };
+	size_t i;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <host dir> <filename...>");
+
+	for (int a = 2; a < t_arg->argc; a++)
+		bulk_add_job(&b, t_arg->argv[a],
+			     path_join(t_arg->argv[1], t_arg->argv[a]));
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	b.prepare = export_prepare;
+	b.store = export_store;
+	bulk_run(&b, "Exported");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (i = 0; i < b.njobs; i++)
+		free(b.jobs[i].path);
+	free(b.jobs);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -259,6 +659,68 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+/* Read files in small chunks, then print what the library measured */
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_stats st;
+	char buf[4096];
+	int i, fs_fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>...]");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	for (i = 1; i < t_arg->argc; i++) {
+		fs_fd = fs_open(t_arg->argv[i]);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+		while (fs_read(fs_fd, buf, sizeof(buf)) > 0)
+			;
+		if (fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (fs_stats(&st))
+		die("Statistics were compiled out");
+
+	printf("%-16s %8s %6s %12s %10s %10s %10s\n", "op", "calls",
+	       "errors", "bytes", "p50_ns", "p99_ns", "max_ns");
+	for (i = 0; i < FS_OP_COUNT; i++) {
+		struct fs_op_stats *os = &st.ops[i];
+
+		if (!os->calls)
+			continue;
+		printf("%-16s %8llu %6llu %12llu %10llu %10llu %10llu\n",
+		       fs_op_name(i), (unsigned long long)os->calls,
+		       (unsigned long long)os->errors,
+		       (unsigned long long)os->bytes,
+		       (unsigned long long)os->p50_ns,
+		       (unsigned long long)os->p99_ns,
+		       (unsigned long long)os->max_ns);
+	}
+	printf("bounces=%llu rmw=%llu fat_flushed=%llu\n",
+	       (unsigned long long)st.bounces, (unsigned long long)st.rmw,
+	       (unsigned long long)st.fat_flushed);
+	printf("blocks read=%llu (%llu calls) written=%llu (%llu calls)\n",
+	       (unsigned long long)st.io.reads,
+	       (unsigned long long)st.io.read_calls,
+	       (unsigned long long)st.io.writes,
+	       (unsigned long long)st.io.write_calls);
+	printf("cache hits=%llu misses=%llu\n",
+	       (unsigned long long)st.io.cache_hits,
+	       (unsigned long long)st.io.cache_misses);
+}
+
 //tests the lseek function
 //Reads half of the file, rounded up
 void thread_fs_lseek(void *arg)
@@ -332,6 +794,32 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	int version = FS_FORMAT_V2;
+	size_t data_blocks, block_size = BLOCK_SIZE;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <data blocks> [v1|v2] [block size]");
+
+	data_blocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2) {
+		if (!strcmp(t_arg->argv[2], "v1"))
+			version = FS_FORMAT_V1;
+		else if (strcmp(t_arg->argv[2], "v2"))
+			die("Unknown format '%s'", t_arg->argv[2]);
+	}
+	if (t_arg->argc > 3)
+		block_size = get_argv(t_arg->argv[3]);
+
+	if (fs_format(t_arg->argv[0], data_blocks, block_size, version))
+		die("Cannot format diskname");
+
+	printf("Formatted '%s' with %zu data blocks of %zu bytes (v%d)\n",
+	       t_arg->argv[0], data_blocks, block_size, version);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -343,6 +831,10 @@ static struct {
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
 	{ "lseek",	thread_fs_lseek },
+	{ "stats",	thread_fs_stats },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
+	{ "format",	thread_fs_format },
 };
 
 void usage(char *program)